@@ -35,6 +35,15 @@ static inline atomic_t atomic_reset(atomic_t *atm){
     return __sync_fetch_and_and(atm, 0);
 }
 
+// pointer helpers, all of them are full barriers
+static inline void *atomic_xchg_ptr(void *ptr, void *val){
+    return __atomic_exchange_n((void **)ptr, val, __ATOMIC_SEQ_CST);
+}
+
+static inline int atomic_cas_ptr(void *ptr, void *old, void *val){
+    return __sync_bool_compare_and_swap((void **)ptr, old, val);
+}
+
 #ifdef __cplusplus
 }
 #endif
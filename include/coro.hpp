@@ -0,0 +1,473 @@
+/*
+ * Copyright (c) 2013, Konghan. All rights reserved.
+ * Distributed under the BSD license, see the LICENSE file.
+ */
+
+#ifndef __CORO_HPP__
+#define __CORO_HPP__
+
+/*
+ * C++20 coroutines over emitters and edpnet socks, header only
+ *
+ *   edp::task serve(edp::sock &s, ioctx_t *ioc){
+ *	int ret = co_await s.read(ioc);
+ *	...
+ *	ret = co_await s.write(ioc);
+ *   }
+ *
+ * a task starts right away on the calling thread and frees itself when
+ * it returns. its frame comes from a per-thread size-classed pool and
+ * every awaiter lives in the frame, with the edp_event_t that resumes
+ * it: an await allocates nothing. an await suspended on a worker is
+ * resumed by an ordered event bound to that worker, an operation which
+ * completes before the await suspended resumes without any event.
+ */
+
+#if __cplusplus < 202002L
+#error "coro.hpp needs C++20"
+#endif
+
+#include "edp.h"
+#include "emitter.h"
+#include "edpnet.h"
+#include "ioctx.h"
+#include "mcache.h"
+
+#include <atomic>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+
+namespace edp{
+
+/*
+ * coroutine frame allocator
+ */
+constexpr size_t	kCORO_FRAME_CLASS = 64;	    // frame sizes round up to it
+constexpr size_t	kCORO_FRAME_CLASSES = 32;   // larger ones go to the heap
+constexpr int		kCORO_FRAME_POOL_MAX = 64;  // idle frames a thread keeps per class
+
+namespace detail{
+
+struct frame_node{
+    frame_node		*fn_next;
+};
+
+struct frame_pool{
+    frame_node		*fp_free[kCORO_FRAME_CLASSES] = {};
+    int			fp_pooled[kCORO_FRAME_CLASSES] = {};
+
+    ~frame_pool(){
+	frame_node  *fn;
+	size_t	    i;
+
+	for(i = 0; i < kCORO_FRAME_CLASSES; i++){
+	    while((fn = fp_free[i]) != nullptr){
+		fp_free[i] = fn->fn_next;
+		mheap_free(fn);
+	    }
+	}
+    }
+};
+
+inline thread_local frame_pool	__frame_pool;
+
+} // namespace detail
+
+// a frame may be freed on another thread than it came from, it joins
+// that thread's pool then
+inline void *frame_alloc(size_t size) noexcept{
+    detail::frame_pool	*fp = &detail::__frame_pool;
+    detail::frame_node	*fn;
+    size_t		cls = (size + kCORO_FRAME_CLASS - 1) / kCORO_FRAME_CLASS - 1;
+
+    if(cls >= kCORO_FRAME_CLASSES)
+	return mheap_alloc(size);
+
+    fn = fp->fp_free[cls];
+    if(fn != nullptr){
+	fp->fp_free[cls] = fn->fn_next;
+	fp->fp_pooled[cls]--;
+	return fn;
+    }
+
+    return mheap_alloc((cls + 1) * kCORO_FRAME_CLASS);
+}
+
+inline void frame_free(void *ptr, size_t size) noexcept{
+    detail::frame_pool	*fp = &detail::__frame_pool;
+    detail::frame_node	*fn = (detail::frame_node *)ptr;
+    size_t		cls = (size + kCORO_FRAME_CLASS - 1) / kCORO_FRAME_CLASS - 1;
+
+    if((cls >= kCORO_FRAME_CLASSES) || (fp->fp_pooled[cls] >= kCORO_FRAME_POOL_MAX)){
+	mheap_free(ptr);
+	return ;
+    }
+
+    fn->fn_next = fp->fp_free[cls];
+    fp->fp_free[cls] = fn;
+    fp->fp_pooled[cls]++;
+}
+
+/*
+ * detached task, check valid() for a frame that could not be allocated
+ */
+class task{
+public:
+    struct promise_type{
+	static void *operator new(size_t size) noexcept{
+	    return frame_alloc(size);
+	}
+
+	static void operator delete(void *ptr, size_t size) noexcept{
+	    frame_free(ptr, size);
+	}
+
+	static task get_return_object_on_allocation_failure() noexcept{
+	    return task(false);
+	}
+
+	task get_return_object() noexcept{
+	    return task(true);
+	}
+
+	std::suspend_never initial_suspend() noexcept{
+	    return {};
+	}
+
+	std::suspend_never final_suspend() noexcept{
+	    return {};
+	}
+
+	void return_void() noexcept{
+	}
+
+	void unhandled_exception() noexcept{
+	    std::terminate();
+	}
+    };
+
+    bool valid() const{
+	return t_valid;
+    }
+
+private:
+    explicit task(bool valid) : t_valid(valid){
+    }
+
+    bool		t_valid;
+};
+
+/*
+ * resumes a suspended coroutine on the worker it suspended on
+ *
+ * r_done settles who resumes it: the completion coming before the await
+ * suspended lets await_suspend return false, one coming after dispatches
+ * r_event. r_step, if set, runs on the worker first and returns false
+ * when the operation waits again.
+ */
+class resumer{
+public:
+    explicit resumer(int priority = kEDP_EVENT_PRIORITY_NORM)
+	: r_priority((short)priority), r_owner(-1), r_result(0),
+	r_step(nullptr), r_done(false){
+    }
+
+    resumer(const resumer &) = delete;
+    resumer &operator=(const resumer &) = delete;
+
+protected:
+    void park(std::coroutine_handle<> h){
+	r_handle = h;
+	r_owner = __edp_self();
+	r_done.store(false, std::memory_order_relaxed);
+    }
+
+    // after park and the operation started: true if it has to wait
+    bool settle(){
+	return !r_done.exchange(true, std::memory_order_acq_rel);
+    }
+
+    // operation completed, from any thread
+    void complete(int result){
+	r_result = result;
+	if(!r_done.exchange(true, std::memory_order_acq_rel))
+	    return ;	// await_suspend is still running, it goes on
+
+	wake();
+    }
+
+    // dispatch r_event, the coroutine is suspended for sure
+    void wake(){
+	edp_event_t	*ev = &r_event;
+
+	// shedding it would lose the coroutine
+	edp_event_init(ev, 0, r_priority);
+	ev->ev_flags = kEDP_EVENT_FLAG_KEEP;
+	if(r_owner >= 0){
+	    ev->ev_flags |= kEDP_EVENT_FLAG_ORDERED;
+	    ev->ev_cpuid = (short)r_owner;
+	}
+	ev->ev_cb = resume_done;
+	ev->ev_data = nullptr;
+	ev->ev_emit = this;
+	ev->ev_handler = resume_handler;
+
+	// out of workers or shutting down, better here than never
+	if(__edp_dispatch(ev) != 0)
+	    resume_handler(this, ev);
+    }
+
+    short		r_priority;
+    int			r_owner;    // worker it suspended on, -1 for any
+    int			r_result;
+    bool		(*r_step)(resumer *rs);
+
+private:
+    static void resume_handler(void *edm, struct edp_event *ev){
+	resumer	    *rs = (resumer *)edm;
+
+	ev->ev_flags &= ~kEDP_EVENT_FLAG_CANCELED;
+	if((rs->r_step != nullptr) && !rs->r_step(rs))
+	    return ;
+
+	rs->r_handle.resume();
+    }
+
+    static void resume_done(edp_event_t *ev, void *data, int errcode){
+    }
+
+    std::coroutine_handle<>	r_handle;
+    std::atomic<bool>		r_done;
+    edp_event_t			r_event;
+};
+
+/*
+ * emitter, co_await em.dispatch(ev) gives the handler's result
+ */
+class emitter{
+public:
+    class dispatch_awaiter : public resumer{
+    public:
+	dispatch_awaiter(emit_t em, edp_event_t *ev) : da_emit(em), da_event(ev){
+	}
+
+	bool await_ready() const noexcept{
+	    return false;
+	}
+
+	bool await_suspend(std::coroutine_handle<> h){
+	    int	    ret;
+
+	    park(h);
+
+	    ret = emit_dispatch(da_emit, da_event, dispatch_done, this);
+	    if(ret != 0){
+		r_result = ret;
+		return false;
+	    }
+
+	    return settle();
+	}
+
+	int await_resume() const noexcept{
+	    return r_result;
+	}
+
+    private:
+	static void dispatch_done(edp_event_t *ev, void *data, int errcode){
+	    ((dispatch_awaiter *)data)->complete(errcode);
+	}
+
+	emit_t		da_emit;
+	edp_event_t	*da_event;
+    };
+
+    explicit emitter(emit_t em) : e_emit(em){
+    }
+
+    emit_t get() const{
+	return e_emit;
+    }
+
+    // ev is set up with edp_event_init, its ev_cb & ev_data are taken
+    dispatch_awaiter dispatch(edp_event_t *ev){
+	return dispatch_awaiter(e_emit, ev);
+    }
+
+private:
+    emit_t		e_emit;
+};
+
+/*
+ * edpnet sock, connected already
+ *
+ * takes the sock's callbacks over while it lives. one read may wait at
+ * a time, writes complete in order. reads give bytes read, 0 at the end
+ * of stream or -errno, writes give what edpnet_writecb gets.
+ */
+class sock{
+public:
+    class read_awaiter : public resumer{
+    public:
+	read_awaiter(sock *s, ioctx_t *ioc) : ra_sock(s), ra_ioc(ioc){
+	    r_step = step;
+	}
+
+	bool await_ready(){
+	    return ra_sock->try_read(ra_ioc, &r_result);
+	}
+
+	bool await_suspend(std::coroutine_handle<> h){
+	    park(h);
+	    return ra_sock->wait(this);
+	}
+
+	int await_resume() const noexcept{
+	    return r_result;
+	}
+
+    private:
+	friend class sock;
+
+	// woken by data_ready, read or wait again
+	static bool step(resumer *rs){
+	    read_awaiter    *ra = (read_awaiter *)rs;
+
+	    return !ra->ra_sock->wait(ra);
+	}
+
+	sock		*ra_sock;
+	ioctx_t		*ra_ioc;
+    };
+
+    class write_awaiter : public resumer{
+    public:
+	write_awaiter(sock *s, ioctx_t *ioc) : wa_sock(s), wa_ioc(ioc){
+	}
+
+	bool await_ready() const noexcept{
+	    return false;
+	}
+
+	bool await_suspend(std::coroutine_handle<> h){
+	    park(h);
+
+	    // write_done may come before edpnet_sock_write returns
+	    wa_ioc->ioc_priv = this;
+	    edpnet_sock_write(wa_sock->s_sock, wa_ioc, write_done);
+
+	    return settle();
+	}
+
+	int await_resume() const noexcept{
+	    return r_result;
+	}
+
+    private:
+	static void write_done(struct edpnet_sock *s, struct ioctx *ioc, int errcode){
+	    ((write_awaiter *)ioc->ioc_priv)->complete(errcode);
+	}
+
+	sock		*wa_sock;
+	ioctx_t		*wa_ioc;
+    };
+
+    explicit sock(edpnet_sock_t s) : s_sock(s), s_reader(kSOCK_WAIT_NONE), s_closed(false){
+	s_cbs.sock_connect = sock_connect;
+	s_cbs.data_ready = data_ready;
+	s_cbs.data_drain = sock_event;
+	s_cbs.sock_error = sock_close;
+	s_cbs.sock_close = sock_close;
+
+	edpnet_sock_set(s_sock, &s_cbs, this);
+    }
+
+    sock(const sock &) = delete;
+    sock &operator=(const sock &) = delete;
+
+    edpnet_sock_t get() const{
+	return s_sock;
+    }
+
+    read_awaiter read(ioctx_t *ioc){
+	return read_awaiter(this, ioc);
+    }
+
+    write_awaiter write(ioctx_t *ioc){
+	return write_awaiter(this, ioc);
+    }
+
+private:
+    // s_reader holds the waiting read_awaiter or one of these
+    static constexpr uintptr_t	kSOCK_WAIT_NONE = 0;
+    static constexpr uintptr_t	kSOCK_WAIT_READY = 1;	// data_ready came
+
+    // true if the read is done, ret set
+    bool try_read(ioctx_t *ioc, int *ret){
+	*ret = edpnet_sock_read(s_sock, ioc);
+	if(*ret != -EAGAIN)
+	    return true;
+
+	if(s_closed.load(std::memory_order_acquire)){
+	    *ret = -kEDPNET_ERR_CLOSE;
+	    return true;
+	}
+
+	return false;
+    }
+
+    // park ra until data_ready, false if the read is done now. edpnet
+    // clears its ready bit before read(2) and calls data_ready on every
+    // edge, so one coming after our EAGAIN shows up as kSOCK_WAIT_READY.
+    bool wait(read_awaiter *ra){
+	uintptr_t   none;
+
+	while(!try_read(ra->ra_ioc, &ra->r_result)){
+	    none = kSOCK_WAIT_NONE;
+	    if(s_reader.compare_exchange_strong(none, (uintptr_t)ra, std::memory_order_acq_rel))
+		return true;
+
+	    // data_ready came meanwhile, read again
+	    s_reader.store(kSOCK_WAIT_NONE, std::memory_order_relaxed);
+	}
+
+	return false;
+    }
+
+    void notify(){
+	uintptr_t   old;
+
+	old = s_reader.exchange(kSOCK_WAIT_READY, std::memory_order_acq_rel);
+	if(old > kSOCK_WAIT_READY)
+	    ((read_awaiter *)old)->wake();
+    }
+
+    static void data_ready(edpnet_sock_t es, void *data){
+	((sock *)data)->notify();
+    }
+
+    static void sock_close(edpnet_sock_t es, void *data){
+	sock	    *s = (sock *)data;
+
+	s->s_closed.store(true, std::memory_order_release);
+	s->notify();
+    }
+
+    // a sock not connected yet may see a hang up before
+    static void sock_connect(edpnet_sock_t es, void *data){
+	((sock *)data)->s_closed.store(false, std::memory_order_release);
+    }
+
+    static void sock_event(edpnet_sock_t es, void *data){
+    }
+
+    edpnet_sock_t		s_sock;
+    edpnet_sock_cbs_t		s_cbs;
+    std::atomic<uintptr_t>	s_reader;
+    std::atomic<bool>		s_closed;
+};
+
+} // namespace edp
+
+#endif // __CORO_HPP__
@@ -9,6 +9,8 @@
 #include "edp_sys.h"
 
 #include "list.h"
+#include "mpscq.h"
+#include "histo.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -22,6 +24,19 @@ enum edp_event_priority{
     kEDP_EVENT_PRIORITY_HIGH,
     kEDP_EVENT_PRIORITY_EMRG,
     kEDP_EVENT_PRIORITY_CRIT,
+    kEDP_EVENT_PRIORITY_MAX,
+};
+
+enum edp_event_flags{
+    kEDP_EVENT_FLAG_ORDERED = 0x0001,	// keep emitter's order, never stolen
+    kEDP_EVENT_FLAG_LOCAL   = 0x0002,	// queue on the dispatching worker
+    kEDP_EVENT_FLAG_CANCELED = 0x0004,	// complete without running handler
+    kEDP_EVENT_FLAG_KEEP    = 0x0008,	// never shed or rejected by queue management
+};
+
+// errors beyond errno, passed negative like errno ones
+enum edp_error_code{
+    kEDP_ERR_OVERLOAD = 512,	// shed or rejected by queue management
 };
 
 struct edp_event;
@@ -29,12 +44,17 @@ typedef void (*edp_event_cb)(struct edp_event *ev, void *data, int errcode);
 typedef void (*edp_event_handler)(void *edm, struct edp_event *ev);
 
 typedef struct edp_event{
-    struct list_head	ev_node;    // for scheduler
+    union{
+	struct list_head    ev_node;	// for scheduler
+	mpscq_node_t	    ev_qnode;	// for worker's lock free queue
+    };
 
     short		ev_type;
     short		ev_priority;
     short		ev_cpuid;
-    short		ev_reserved;
+    short		ev_flags;   // enum edp_event_flags
+    uint64_t		ev_deadline; // ns of spi_time_now(), 0 for none
+    uint64_t		ev_stamp;   // ns queued at, if sojourn is measured
 
     edp_event_cb	ev_cb;
     void		*ev_data;
@@ -47,20 +67,203 @@ static inline void edp_event_init(edp_event_t *ev, short type, short priority){
     ev->ev_type = type;
     ev->ev_priority = priority;
     ev->ev_cpuid = -1;
+    ev->ev_flags = 0;
+    ev->ev_stamp = 0;
+    ev->ev_deadline = 0;
 
     INIT_LIST_HEAD(&ev->ev_node);
 }
 
+// run it earliest deadline first, between EMRG and HIGH events.
+// only for HIGH or lower priority, it's not kept in FIFO order.
+static inline void edp_event_deadline(edp_event_t *ev, uint32_t us){
+    ev->ev_deadline = spi_time_now() + (uint64_t)us * 1000;
+}
+
 static inline void edp_event_done(edp_event_t *ev, int errcode){
     if(ev != NULL)
         ev->ev_cb(ev, ev->ev_data, errcode);
 }
 
+/*
+ * events with an inline payload: one allocation and one cache miss for
+ * both. blocks come in power of two classes up to 4KB, larger ones from
+ * the heap. each thread keeps some free blocks per class and trades them
+ * with a shared pool in batches, so an event may be freed on any thread.
+ */
+edp_event_t *edp_event_alloc(short type, short priority, size_t size);
+void edp_event_free(edp_event_t *ev);
+
+// give the calling thread's free blocks back before it exits. workers &
+// eio threads do it themselves, other threads that alloc or free events
+// call it last, or their blocks leak.
+void edp_event_drain(void);
+
+// payload size asked for, it follows the event 8 bytes aligned
+size_t edp_event_size(edp_event_t *ev);
+
+static inline void *edp_event_payload(edp_event_t *ev){
+    return (void *)(ev + 1);
+}
+
+// how __edp_dispatch picks a worker for a new event
+enum edp_select_policy{
+    kEDP_SELECT_ROUND = 0,	// plain round-robin
+    kEDP_SELECT_P2C,		// lighter one of two random workers
+};
+
+// where worker and eio threads run
+enum edp_affinity{
+    kEDP_AFFINITY_NONE = 0,	// let the kernel move them
+    kEDP_AFFINITY_NUMA,		// eio then workers, filling numa nodes in order
+    kEDP_AFFINITY_USER,		// ec_worker_cpus & ec_eio_cpus
+};
+
+// what the thread calling edp_loop does. its worker & eio slots get no
+// thread of their own, so call edp_loop soon after edp_init.
+enum edp_loop_mode{
+    kEDP_LOOP_SLEEP = 0,	// nothing, it just sleeps
+    kEDP_LOOP_EIO = 1,		// polls fds as eio thread 0
+    kEDP_LOOP_WORKER = 2,	// runs worker 0
+    kEDP_LOOP_BOTH = 3,		// runs worker 0, polls fds when idle
+};
+
+typedef struct edp_conf{
+    int			ec_workers;	// worker threads number
+    int			ec_select;	// enum edp_select_policy
+    int			ec_spin_us;	// idle worker spins before sleep
+    int			ec_weights[kEDP_EVENT_PRIORITY_MAX]; // 0 for strict
+    int			ec_latency;	// record wait & run time histograms, 0 for off
+
+    int			ec_worker_min;	// autoscaler keeps at least
+    int			ec_worker_max;	// worker slots, resize limit
+    int			ec_scale_ms;	// autoscaler period, 0 for off
+    int			ec_sojourn_us;	// queue wait that adds a worker
+    int			ec_idle_ms;	// idle time that retires a worker
+
+    // CoDel on NORM & IDLE queues: waits above ec_codel_us for ec_codel_ms
+    // make workers shed events, more often while it lasts, and dispatch
+    // reject new ones. shed ones complete with -kEDP_ERR_OVERLOAD and their
+    // handler never runs. ordered, deadline & KEEP events are kept, emitter
+    // timers are KEEP. strand events are managed like the queue of their
+    // strand's priority.
+    int			ec_codel_us;	// queue wait target, 0 for off
+    int			ec_codel_ms;	// wait above target this long sheds
+
+    // NORM & IDLE events waiting ec_aging_ms move one priority up, and
+    // again after each further ec_aging_ms. 0 for off.
+    int			ec_aging_ms;
+
+    int			ec_eio_threads;	// epoll threads number
+    int			ec_affinity;	// enum edp_affinity
+    // kEDP_AFFINITY_USER: a cpu per worker slot, max(ec_workers,
+    // ec_worker_max) of them, and one per eio thread, -1 for any. edp_init
+    // copies them.
+    int			*ec_worker_cpus;
+    int			*ec_eio_cpus;
+
+    int			ec_loop;	// enum edp_loop_mode
+}edp_conf_t;
+
+static inline void edp_conf_init(edp_conf_t *conf, int thread_num){
+    memset(conf, 0, sizeof(*conf));
+
+    conf->ec_workers = thread_num;
+    conf->ec_select = kEDP_SELECT_ROUND;
+    conf->ec_spin_us = 50;
+
+    // strict CRIT & EMRG, others share workers 25:5:1
+    conf->ec_weights[kEDP_EVENT_PRIORITY_HIGH] = 25;
+    conf->ec_weights[kEDP_EVENT_PRIORITY_NORM] = 5;
+    conf->ec_weights[kEDP_EVENT_PRIORITY_IDLE] = 1;
+
+    conf->ec_worker_min = thread_num;
+    conf->ec_worker_max = thread_num;
+    conf->ec_sojourn_us = 1000;
+    conf->ec_idle_ms = 1000;
+
+    conf->ec_codel_us = 0;
+    conf->ec_codel_ms = 100;
+    conf->ec_aging_ms = 0;
+
+    conf->ec_eio_threads = 1;
+    conf->ec_affinity = kEDP_AFFINITY_NONE;
+
+    conf->ec_loop = kEDP_LOOP_SLEEP;
+}
+
+enum edp_thread_kind{
+    kEDP_THREAD_WORKER = 0,
+    kEDP_THREAD_EIO,
+};
+
 // used internally
 int __edp_dispatch(edp_event_t *ev);
+int __edp_dispatch_batch(edp_event_t **evs, int num);
+
+// queue management of events queued outside the workers, at priority:
+// stamp when queued, admit gives -kEDP_ERR_OVERLOAD if worker cpuid's
+// queue rejects new ones, shed is 1 if the running worker sheds it now.
+// handlers whose events need more than their cb called when shed hook
+// a shed path, the worker calls it in place of the handler.
+void __edp_stamp(edp_event_t *ev);
+int __edp_admit(edp_event_t *ev, int cpuid, int priority);
+int __edp_shed(edp_event_t *ev, int priority);
+int __edp_shed_hook(edp_event_handler handler, edp_event_handler shed);
+int __edp_select(void);
+int __edp_self(void);	// worker id of the calling thread, -1 if none
+
+// home worker of an emitter's ordered events: the worker in the low 32
+// bits, the handovers it had done then in the high ones. __edp_home gives
+// where they go now, idle if the emitter has none of them pending.
+#define kEDP_HOME_NONE		((uint64_t)-1)
+#define kEDP_HOME_CPUID(home)	((int)(uint32_t)(home))
+uint64_t __edp_home(uint64_t home, int idle);
+
+int __edp_event_init(void);
+int __edp_event_fini(void);
+
+const edp_conf_t *__edp_getconf(void);
+int __edp_thread_cpu(int kind, int index);
 
 int edp_init(int thread_num);
+int edp_init_conf(edp_conf_t *conf);
+
+// active workers now, resize them within [1, ec_worker_max]. retired
+// workers hand their queued events over to the others, ordered ones and
+// timers to worker 0.
+int edp_workers();
+int edp_workers_resize(int num);
+
+// events of all workers which finished after their deadline
+uint64_t edp_deadline_missed();
+
+typedef struct edp_stats{
+    uint64_t		es_handled[kEDP_EVENT_PRIORITY_MAX];
+    uint64_t		es_pending[kEDP_EVENT_PRIORITY_MAX];
+    uint64_t		es_deadline_handled;
+    uint64_t		es_deadline_missed;
+    uint64_t		es_stolen;
+    uint64_t		es_shed;    // completed with -kEDP_ERR_OVERLOAD
+    uint64_t		es_promoted;// moved up a priority by aging
+}edp_stats_t;
+
+// counters of one worker, or summed over all workers if worker < 0
+int edp_stats(int worker, edp_stats_t *stats);
+
+enum edp_latency{
+    kEDP_LATENCY_WAIT = 0,	// dispatch to handler start, ns
+    kEDP_LATENCY_RUN,		// handler time, ns
+};
+
+// add latency histogram of worker & priority to histo, < 0 for all of
+// them. reset clears what was taken. histograms stay empty unless
+// ec_latency is set, it reads the clock at dispatch & around handlers.
+int edp_latency(int worker, int priority, int kind, histo_t *histo, int reset);
+// run the ec_loop work on this thread until edp_loop_break. call edp_fini
+// from the same thread after it returns.
 int edp_loop();
+int edp_loop_break();
 int edp_fini();
 
 #ifdef __cplusplus
@@ -118,6 +118,7 @@ int edpnet_sock_connect(edpnet_sock_t sock, edpnet_addr_t *addr);
 int edpnet_sock_close(edpnet_sock_t sock);
 
 int edpnet_sock_write(edpnet_sock_t sock, ioctx_t *ioctx, edpnet_writecb cb);
+// bytes read, -EAGAIN until the next data_ready, or -errno
 int edpnet_sock_read(edpnet_sock_t sock, ioctx_t *ioctx);
 
 /*
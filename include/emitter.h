@@ -7,26 +7,137 @@
 #define __EMITTER_H__
 
 #include "edp.h"
+#include "timer.h"
 #include "atomic.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define kEMIT_EVENT_TYPE_MAX		16
+#define kEMIT_EVENT_TYPE_MAX		16	// emitters of their own handlers
+#define kEMIT_CLASS_TYPE_MAX		32768	// ev_type is a short
 
 struct edp_emit;
 typedef struct edp_emit *emit_t;
 typedef int (*emit_handler)(emit_t em, edp_event_t *ev);
 
+/*
+ * emitter classes: one handler table shared by many emitters
+ *
+ * types are [0, types), the table only keeps pages of the types which
+ * have a handler. add the handlers before the first emit_create_class,
+ * the class is read only from then on. destroy it after its emitters.
+ */
+struct emit_class;
+typedef struct emit_class *emit_class_t;
+
+int emit_class_create(int types, emit_class_t *ec);
+int emit_class_destroy(emit_class_t ec);
+int emit_class_add_handler(emit_class_t ec, int type, emit_handler handler);
+
+/*
+ * coalescing types, below kEMIT_COALESCE_TYPE_MAX: while an event of
+ * such a type is queued for an emitter, emit_prepare and emit_dispatch
+ * of another one give -EALREADY and don't call its cb, the queued one
+ * stands for both. it stops standing for later ones when its handler
+ * starts, so the handler sees every change made before.
+ */
+#define kEMIT_COALESCE_TYPE_MAX		64
+
+int emit_class_coalesce(emit_class_t ec, int type);
+int emit_coalesce(emit_t em, int type);
+
+// -kEDP_ERR_OVERLOAD if queue management rejects it, -EALREADY if it is
+// coalesced, cb is not called then
 int emit_dispatch(emit_t em, edp_event_t *ev, edp_event_cb cb, void *data);
 
+// prepare events for their emitters, then dispatch them all at once:
+// one queue push per target worker & priority, one wakeup per worker.
+// ones queue management rejects complete with -kEDP_ERR_OVERLOAD, ones
+// workers refuse complete with the error returned.
+int emit_prepare(emit_t em, edp_event_t *ev, edp_event_cb cb, void *data);
+int emit_dispatch_batch(edp_event_t **evs, int num);
+
+// dispatch one event prepared by emit_prepare
+int emit_submit(edp_event_t *ev);
+
+/*
+ * fan out: ev goes to num emitters' handlers of ev_type at once
+ *
+ * each subscriber gets a small node event, all of them from a single
+ * allocation, and handlers reach ev by emit_published. ev is shared,
+ * handlers only read it. cb is called once when the last subscriber
+ * finished, with 0 or the first error one of them gave. an emitter the
+ * event coalesced on counts as delivered. handlers may keep ev past
+ * their return with emit_publish_hold & _release.
+ */
+int emit_publish(emit_t *ems, int num, edp_event_t *ev, edp_event_cb cb, void *data);
+
+// published event a delivered one carries, NULL if it is no fan out one
+edp_event_t *emit_published(edp_event_t *ev);
+void emit_publish_hold(edp_event_t *ev);
+void emit_publish_release(edp_event_t *ev);
+
+// strand mode: events of the emitter run on one worker at a time, in the
+// order they were dispatched, at the strand's priority. the strand moves
+// to another worker only when it has no events left.
+int emit_strand(emit_t em, int priority);
+
+// fiber mode: each event's handler runs on a fiber of its worker and may
+// wait there with fiber_suspend (fiber.h), the event completes when the
+// handler returns. not for strands, their order can't hold over suspends.
+int emit_fiber(emit_t em);
+
+/*
+ * delayed & periodic dispatch, on the timer wheels of the workers
+ *
+ * mt_timer.et_event is the event dispatched, set it up with
+ * emit_timer_init. a periodic one is dispatched again ms after the time
+ * it was due last, once its previous run completed.
+ *
+ * emit_timer_cancel returns 0 if it stopped the timer, cb then gets
+ * -ECANCELED once as its last call. a one shot timer that fired already
+ * gives -ENOENT and completes as usual. a periodic one that can't be
+ * armed again stops too, its last call gets the error arming gave.
+ */
+typedef struct emit_timer{
+    edp_timer_t		mt_timer;
+    uint32_t		mt_period;  // ms, 0 for once or stopped
+    edp_event_cb	mt_cb;
+    void		*mt_data;
+}emit_timer_t;
+
+static inline void emit_timer_init(emit_timer_t *mt, short type, short priority){
+    edp_timer_init(&mt->mt_timer);
+    edp_event_init(&mt->mt_timer.et_event, type, priority);
+    mt->mt_period = 0;
+    mt->mt_cb = NULL;
+    mt->mt_data = NULL;
+}
+
+static inline emit_timer_t *emit_timer_of(edp_event_t *ev){
+    return container_of(edp_timer_of(ev), emit_timer_t, mt_timer);
+}
+
+int emit_dispatch_after(emit_t em, emit_timer_t *mt, edp_event_cb cb, void *data, uint32_t ms);
+int emit_dispatch_every(emit_t em, emit_timer_t *mt, edp_event_cb cb, void *data, uint32_t ms);
+int emit_timer_cancel(emit_timer_t *mt);
+
+// handlers of an emitter created by emit_create, types below
+// kEMIT_EVENT_TYPE_MAX. -EPERM for emitters of a class.
 int emit_add_handler(emit_t em, int type, emit_handler handler);
 int emit_rmv_handler(emit_t em, int type);
 
 int emit_create(void *data, emit_t *em);
+int emit_create_class(emit_class_t ec, void *data, emit_t *em);
 int emit_destroy(emit_t em);
 
+// call visit on every emitter until it returns non zero, which is given
+// back then. for diagnostics: it holds a registry shard's lock meanwhile,
+// so visit must not create or destroy emitters.
+typedef int (*emit_visit)(emit_t em, void *arg);
+int emit_foreach(emit_visit visit, void *arg);
+
 void *emit_get(emit_t em);
 void *emit_set(emit_t em, void *data);
 
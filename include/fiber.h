@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2013, Konghan. All rights reserved.
+ * Distributed under the BSD license, see the LICENSE file.
+ */
+
+#ifndef __FIBER_H__
+#define __FIBER_H__
+
+#include "edp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * stackful fibers on the workers
+ *
+ * a fiber runs a function on a small pooled stack. fiber_suspend switches
+ * back to the worker, which goes on with other events; fiber_resume from
+ * any thread queues an ordered event, the worker the fiber suspended on
+ * switches to it again then. switches save a few registers in user space.
+ *
+ * resume a fiber exactly once per suspend. it may be resumed before it
+ * suspends, e.g. by a callback it ran itself: the resume event can not
+ * run before the fiber leaves its worker, suspend returns right after.
+ */
+#define kFIBER_STACK_SIZE	(64 * 1024)
+#define kFIBER_POOL_MAX		64	// idle fibers a thread keeps
+
+typedef struct fiber fiber_t;
+typedef void (*fiber_fn)(void *arg);
+
+// run fn(arg) on a fiber of this worker until it returns or suspends,
+// priority is the one resume events run at. -EPERM outside of workers.
+int fiber_run(fiber_fn fn, void *arg, int priority);
+
+// fiber running now, NULL outside of fibers
+fiber_t *fiber_self(void);
+
+// back to the worker, return the result fiber_resume gives
+int fiber_suspend(void);
+int fiber_resume(fiber_t *fb, int result);
+
+// suspend for ms on the worker's timer wheel
+int fiber_sleep(uint32_t ms);
+
+// used internally, free the idle fibers of a worker thread leaving
+void __fiber_drain(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __FIBER_H__
+
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2013, Konghan. All rights reserved.
+ * Distributed under the BSD license, see the LICENSE file.
+ */
+
+#ifndef __HISTO_H__
+#define __HISTO_H__
+
+#include "edp_sys.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * log-linear latency histogram, HDR style
+ *
+ * values below 2^kHISTO_SUB_BITS have their own bucket, every power of two
+ * above it is split into 2^kHISTO_SUB_BITS buckets, so a bucket is at most
+ * 1/16 wide of the values in it. values from 2^kHISTO_MAX_BITS on share
+ * the last bucket.
+ *
+ * one thread records, any thread may take a snapshot or reset it without
+ * locks: every bucket is updated and taken with a single atomic operation.
+ */
+#define kHISTO_SUB_BITS		4
+#define kHISTO_SUB		(1 << kHISTO_SUB_BITS)
+#define kHISTO_MAX_BITS		36	// ~68s in ns
+#define kHISTO_BUCKETS		((kHISTO_MAX_BITS - kHISTO_SUB_BITS + 1) * kHISTO_SUB)
+
+typedef struct histo{
+    uint64_t		hg_max;
+    uint64_t		hg_buckets[kHISTO_BUCKETS];
+}histo_t;
+
+static inline int histo_index(uint64_t val){
+    int	    msb;
+
+    if(val < kHISTO_SUB)
+	return (int)val;
+
+    msb = 63 - __builtin_clzll(val);
+    if(msb >= kHISTO_MAX_BITS)
+	return kHISTO_BUCKETS - 1;
+
+    return ((msb - kHISTO_SUB_BITS + 1) << kHISTO_SUB_BITS) +
+	(int)(val >> (msb - kHISTO_SUB_BITS)) - kHISTO_SUB;
+}
+
+// lowest value of a bucket
+static inline uint64_t histo_value(int index){
+    int	    exp = index >> kHISTO_SUB_BITS;
+
+    if(exp == 0)
+	return (uint64_t)index;
+
+    return (uint64_t)(kHISTO_SUB + (index & (kHISTO_SUB - 1))) << (exp - 1);
+}
+
+static inline void histo_record(histo_t *hg, uint64_t val){
+    __atomic_fetch_add(&hg->hg_buckets[histo_index(val)], 1, __ATOMIC_RELAXED);
+
+    if(val > hg->hg_max)
+	__atomic_store_n(&hg->hg_max, val, __ATOMIC_RELAXED);
+}
+
+// add src to dst, clear src too if reset
+static inline void histo_take(histo_t *dst, histo_t *src, int reset){
+    uint64_t	val;
+    int		i;
+
+    for(i = 0; i < kHISTO_BUCKETS; i++){
+	if(reset){
+	    val = __atomic_exchange_n(&src->hg_buckets[i], 0, __ATOMIC_RELAXED);
+	}else{
+	    val = __atomic_load_n(&src->hg_buckets[i], __ATOMIC_RELAXED);
+	}
+	dst->hg_buckets[i] += val;
+    }
+
+    if(reset){
+	val = __atomic_exchange_n(&src->hg_max, 0, __ATOMIC_RELAXED);
+    }else{
+	val = __atomic_load_n(&src->hg_max, __ATOMIC_RELAXED);
+    }
+    if(val > dst->hg_max)
+	dst->hg_max = val;
+}
+
+static inline uint64_t histo_count(const histo_t *hg){
+    uint64_t	num = 0;
+    int		i;
+
+    for(i = 0; i < kHISTO_BUCKETS; i++)
+	num += hg->hg_buckets[i];
+
+    return num;
+}
+
+// lowest value of the bucket holding the given percentile, 0 - 100
+static inline uint64_t histo_percentile(const histo_t *hg, double pct){
+    uint64_t	num, rank, seen = 0;
+    int		i;
+
+    num = histo_count(hg);
+    if(num == 0)
+	return 0;
+
+    rank = (uint64_t)(num * pct / 100.0);
+    if(rank >= num)
+	return hg->hg_max;
+
+    for(i = 0; i < kHISTO_BUCKETS; i++){
+	seen += hg->hg_buckets[i];
+	if(seen > rank)
+	    break;
+    }
+
+    return histo_value(i);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __HISTO_H__
+
@@ -39,6 +39,7 @@ typedef struct ioctx{
 	    edpnet_writecb	ioc_iocb;
 	    struct edpnet_sock	*ioc_sock;
 	    size_t		ioc_bytes;
+	    void		*ioc_priv;   // caller's, edpnet leaves it alone
 	};
     };
 
@@ -33,6 +33,8 @@ void *mcache_alloc(mcache_t mc);
 void mcache_free(mcache_t mc, void *ptr);
 
 void *mheap_alloc(size_t size);
+// align is a power of two, free it with mheap_free
+void *mheap_alloc_aligned(size_t size, size_t align);
 void mheap_free(void *ptr);
 
 int mcache_init(void *start, uint64_t size);
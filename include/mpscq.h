@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2013, Konghan. All rights reserved.
+ * Distributed under the BSD license, see the LICENSE file.
+ */
+
+#ifndef __MPSCQ_H__
+#define __MPSCQ_H__
+
+#include "edp_sys.h"
+#include "atomic.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * intrusive multi-producer/single-consumer queue
+ *
+ * producers push with a CAS loop (lock free), the consumer takes every
+ * pushed node with one exchange (wait free) and gets them back in FIFO
+ * order. grabbing all nodes is also safe with more than one consumer.
+ */
+typedef struct mpscq_node{
+    struct mpscq_node	*next;
+}mpscq_node_t;
+
+typedef struct mpscq{
+    mpscq_node_t	*mq_head;   // last pushed node
+}mpscq_t;
+
+static inline void mpscq_init(mpscq_t *mq){
+    mq->mq_head = NULL;
+}
+
+static inline int mpscq_empty(mpscq_t *mq){
+    return *(mpscq_node_t * volatile *)&mq->mq_head == NULL;
+}
+
+// push a chain linked from last(newest) to first(oldest) through next
+static inline int mpscq_push_chain(mpscq_t *mq, mpscq_node_t *first,
+	mpscq_node_t *last){
+    mpscq_node_t    *head;
+
+    do{
+	head = *(mpscq_node_t * volatile *)&mq->mq_head;
+	first->next = head;
+    }while(!atomic_cas_ptr(&mq->mq_head, head, last));
+
+    // tell caller queue was empty
+    return head == NULL;
+}
+
+static inline int mpscq_push(mpscq_t *mq, mpscq_node_t *node){
+    return mpscq_push_chain(mq, node, node);
+}
+
+// take all pushed nodes, return them oldest first
+static inline mpscq_node_t *mpscq_grab(mpscq_t *mq){
+    mpscq_node_t    *node, *next, *prev = NULL;
+
+    if(mpscq_empty(mq))
+	return NULL;
+
+    node = (mpscq_node_t *)atomic_xchg_ptr(&mq->mq_head, NULL);
+    while(node != NULL){
+	next = node->next;
+	node->next = prev;
+	prev = node;
+	node = next;
+    }
+
+    return prev;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __MPSCQ_H__
+
@@ -6,10 +6,95 @@
 #ifndef __TIMER_H__
 #define __TIMER_H__
 
+#include "edp.h"
+
+#include "list.h"
+#include "mpscq.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+enum edp_timer_state{
+    kEDP_TIMER_IDLE = 0,
+    kEDP_TIMER_ARMED,
+    kEDP_TIMER_CANCELED,
+    kEDP_TIMER_FIRED,
+};
+
+/*
+ * a timer dispatches its event when it expires, so prepare et_event like
+ * any other event (emit_prepare) before each edp_timer_add. a canceled
+ * timer still delivers it once, flagged kEDP_EVENT_FLAG_CANCELED, and
+ * emitters complete it with -ECANCELED without calling the handler.
+ *
+ * timers belong to the wheel of one worker: the adding worker, or else
+ * the worker et_event is bound to or a selected one. other threads hand
+ * adds and cancels over through lock free queues. arm a timer again only
+ * after its event completed.
+ */
+typedef struct edp_timer{
+    edp_event_t		et_event;   // dispatched when expired
+
+    struct list_head	et_node;    // wheel slot, owner only
+    mpscq_node_t	et_qnode;   // add request to owner
+    mpscq_node_t	et_cnode;   // cancel request to owner
+    uint64_t		et_expire;  // ms of spi_time_now()
+    int			et_state;   // enum edp_timer_state
+    int			et_cpuid;   // owner worker
+    short		et_seen;    // owner took add request, owner only
+    short		et_noted;   // owner took cancel request, owner only
+}edp_timer_t;
+
+static inline void edp_timer_init(edp_timer_t *tm){
+    memset(tm, 0, sizeof(*tm));
+    INIT_LIST_HEAD(&tm->et_node);
+    tm->et_cpuid = -1;
+}
+
+static inline edp_timer_t *edp_timer_of(edp_event_t *ev){
+    return container_of(ev, edp_timer_t, et_event);
+}
+
+// fire et_event after ms
+int edp_timer_add(edp_timer_t *tm, uint32_t ms);
+// -ENOENT if it is not armed any more
+int edp_timer_cancel(edp_timer_t *tm);
+
+/*
+ * hierarchical timing wheel, 1ms ticks, used by one owner thread
+ *
+ * the root wheel holds timers due within 256ms, each of the upper levels
+ * covers 64 times the range of the one below, so 32 bits of ms (~49 days)
+ * in all; later timers wait in the last slot reached. upper slots move
+ * down when the ticks below wrap around. add & del are O(1).
+ */
+#define kTIMER_ROOT_BITS	8
+#define kTIMER_ROOT_SIZE	(1 << kTIMER_ROOT_BITS)
+#define kTIMER_LEVEL_BITS	6
+#define kTIMER_LEVEL_SIZE	(1 << kTIMER_LEVEL_BITS)
+#define kTIMER_LEVELS		4
+
+typedef struct timer_wheel{
+    uint64_t		tw_now;	    // next tick to run
+    int			tw_count;   // timers in the wheel
+
+    struct list_head	tw_root[kTIMER_ROOT_SIZE];
+    struct list_head	tw_levels[kTIMER_LEVELS][kTIMER_LEVEL_SIZE];
+}timer_wheel_t;
+
+typedef void (*timer_expire_cb)(edp_timer_t *tm, void *data);
+
+void timer_wheel_init(timer_wheel_t *tw, uint64_t now);
+
+void timer_wheel_add(timer_wheel_t *tw, edp_timer_t *tm);
+void timer_wheel_del(timer_wheel_t *tw, edp_timer_t *tm);
+
+// expire timers due up to now, return the number of them
+int timer_wheel_run(timer_wheel_t *tw, uint64_t now, timer_expire_cb cb, void *data);
+
+// the tick wheel has work at, 0 if it is empty
+uint64_t timer_wheel_next(timer_wheel_t *tw);
 
 #ifdef __cplusplus
 }
@@ -17,4 +102,3 @@ extern "C" {
 
 #endif // __TIMER_H__
 
-
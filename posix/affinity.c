@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2013, Konghan. All rights reserved.
+ * Distributed under the BSD license, see the LICENSE file.
+ */
+
+#define _GNU_SOURCE
+
+#include "edp_sys.h"
+
+#include <sched.h>
+#include <stdio.h>
+
+#define SPI_NODE_MAX	    64
+
+int spi_thread_create_on(spi_thread_t *thrd, void *(*thread_routine)(void *),
+	void *data, int cpu){
+    pthread_attr_t  attr;
+    cpu_set_t	    *set;
+    size_t	    size;
+    int		    ret;
+
+    if(cpu < 0){
+	return spi_thread_create(thrd, thread_routine, data);
+    }
+
+    // sized for cpu, a cpu_set_t only holds CPU_SETSIZE of them
+    set = CPU_ALLOC(cpu + 1);
+    if(set == NULL){
+	return ENOMEM;
+    }
+    size = CPU_ALLOC_SIZE(cpu + 1);
+
+    ret = pthread_attr_init(&attr);
+    if(ret != 0){
+	CPU_FREE(set);
+	return ret;
+    }
+
+    // bind before it runs, so its stack & first touch memory are local
+    CPU_ZERO_S(size, set);
+    CPU_SET_S(cpu, size, set);
+    ret = pthread_attr_setaffinity_np(&attr, size, set);
+    if(ret == 0){
+	ret = pthread_create(thrd, &attr, thread_routine, data);
+    }
+
+    pthread_attr_destroy(&attr);
+    CPU_FREE(set);
+
+    return ret;
+}
+
+// parse sysfs cpulist format, such as "0-3,8-11"
+static int cpulist_parse(const char *str, int *cpus, int num, int max){
+    char    *end;
+    long    lo, hi;
+
+    while((*str != '\0') && (*str != '\n') && (num < max)){
+	lo = strtol(str, &end, 10);
+	if(end == str)
+	    break;
+
+	hi = lo;
+	if(*end == '-'){
+	    str = end + 1;
+	    hi = strtol(str, &end, 10);
+	}
+
+	for(; (lo <= hi) && (num < max); lo++){
+	    cpus[num++] = (int)lo;
+	}
+
+	str = (*end == ',') ? end + 1 : end;
+    }
+
+    return num;
+}
+
+int spi_cpu_layout(int *cpus, int max){
+    char    path[64];
+    char    buf[256];
+    FILE    *fp;
+    int	    node, num = 0;
+
+    for(node = 0; (node < SPI_NODE_MAX) && (num < max); node++){
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+	fp = fopen(path, "r");
+	if(fp == NULL)
+	    continue;
+
+	if(fgets(buf, sizeof(buf), fp) != NULL){
+	    num = cpulist_parse(buf, cpus, num, max);
+	}
+	fclose(fp);
+    }
+
+    // no numa information, all online cpus in one node
+    if(num == 0){
+	num = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(num > max)
+	    num = max;
+
+	for(node = 0; node < num; node++)
+	    cpus[node] = node;
+    }
+
+    return num;
+}
+
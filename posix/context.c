@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2013, Konghan. All rights reserved.
+ * Distributed under the BSD license, see the LICENSE file.
+ */
+
+#include "edp_sys.h"
+
+#include <sys/mman.h>
+
+/*
+ * a switch pushes the callee saved registers on the old stack, keeps the
+ * stack pointer in from, then pops them from the stack of to. a new
+ * context gets a frame that returns into a trampoline calling entry.
+ */
+#if defined(__x86_64__)
+
+// mxcsr & x87 control word, r15 - r12, rbx, rbp, return address
+#define SPI_CONTEXT_FRAME	    64
+
+__asm__(
+    ".text\n"
+    ".globl __spi_context_switch\n"
+    ".type __spi_context_switch,@function\n"
+    ".p2align 4\n"
+"__spi_context_switch:\n"
+    "pushq %rbp\n"
+    "pushq %rbx\n"
+    "pushq %r12\n"
+    "pushq %r13\n"
+    "pushq %r14\n"
+    "pushq %r15\n"
+    "subq $8, %rsp\n"
+    "stmxcsr (%rsp)\n"
+    "fnstcw 4(%rsp)\n"
+    "movq %rsp, (%rdi)\n"
+    "movq (%rsi), %rsp\n"
+    "ldmxcsr (%rsp)\n"
+    "fldcw 4(%rsp)\n"
+    "addq $8, %rsp\n"
+    "popq %r15\n"
+    "popq %r14\n"
+    "popq %r13\n"
+    "popq %r12\n"
+    "popq %rbx\n"
+    "popq %rbp\n"
+    "ret\n"
+    ".size __spi_context_switch, .-__spi_context_switch\n"
+
+    ".p2align 4\n"
+"__spi_context_start:\n"
+    "movq %r13, %rdi\n"
+    "callq *%r12\n"
+    "ud2\n"
+);
+
+extern void __spi_context_start(void);
+
+void __spi_context_make(__spi_context_t *ctx, void *stack, size_t size,
+	void (*entry)(void *), void *arg){
+    uintptr_t	top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+    uint64_t	*frame = (uint64_t *)(top - SPI_CONTEXT_FRAME);
+
+    memset(frame, 0, SPI_CONTEXT_FRAME);
+    frame[0] = 0x1f80 | ((uint64_t)0x037f << 32);   // default mxcsr & fpu
+    frame[3] = (uint64_t)(uintptr_t)arg;	    // r13
+    frame[4] = (uint64_t)(uintptr_t)entry;	    // r12
+    frame[7] = (uint64_t)(uintptr_t)__spi_context_start;
+
+    ctx->ctx_sp = frame;
+}
+
+#elif defined(__aarch64__)
+
+// x19 - x30, d8 - d15, padded to 16 bytes
+#define SPI_CONTEXT_FRAME	    176
+
+__asm__(
+    ".text\n"
+    ".globl __spi_context_switch\n"
+    ".type __spi_context_switch,%function\n"
+    ".p2align 4\n"
+"__spi_context_switch:\n"
+    "sub sp, sp, #176\n"
+    "stp x19, x20, [sp, #0]\n"
+    "stp x21, x22, [sp, #16]\n"
+    "stp x23, x24, [sp, #32]\n"
+    "stp x25, x26, [sp, #48]\n"
+    "stp x27, x28, [sp, #64]\n"
+    "stp x29, x30, [sp, #80]\n"
+    "stp d8, d9, [sp, #96]\n"
+    "stp d10, d11, [sp, #112]\n"
+    "stp d12, d13, [sp, #128]\n"
+    "stp d14, d15, [sp, #144]\n"
+    "mov x9, sp\n"
+    "str x9, [x0]\n"
+    "ldr x9, [x1]\n"
+    "mov sp, x9\n"
+    "ldp x19, x20, [sp, #0]\n"
+    "ldp x21, x22, [sp, #16]\n"
+    "ldp x23, x24, [sp, #32]\n"
+    "ldp x25, x26, [sp, #48]\n"
+    "ldp x27, x28, [sp, #64]\n"
+    "ldp x29, x30, [sp, #80]\n"
+    "ldp d8, d9, [sp, #96]\n"
+    "ldp d10, d11, [sp, #112]\n"
+    "ldp d12, d13, [sp, #128]\n"
+    "ldp d14, d15, [sp, #144]\n"
+    "add sp, sp, #176\n"
+    "ret\n"
+    ".size __spi_context_switch, .-__spi_context_switch\n"
+
+    ".p2align 4\n"
+"__spi_context_start:\n"
+    "mov x0, x20\n"
+    "blr x19\n"
+    "brk #0\n"
+);
+
+extern void __spi_context_start(void);
+
+void __spi_context_make(__spi_context_t *ctx, void *stack, size_t size,
+	void (*entry)(void *), void *arg){
+    uintptr_t	top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+    uint64_t	*frame = (uint64_t *)(top - SPI_CONTEXT_FRAME);
+
+    memset(frame, 0, SPI_CONTEXT_FRAME);
+    frame[0] = (uint64_t)(uintptr_t)entry;	    // x19
+    frame[1] = (uint64_t)(uintptr_t)arg;	    // x20
+    frame[11] = (uint64_t)(uintptr_t)__spi_context_start;	// x30
+
+    ctx->ctx_sp = frame;
+}
+
+#else
+
+// portable but slower, swapcontext saves the signal mask with a syscall
+static __thread __spi_context_t	*__spi_context_next;
+
+static void spi_context_start(void){
+    __spi_context_t *ctx = __spi_context_next;
+
+    ctx->ctx_entry(ctx->ctx_arg);
+    abort();
+}
+
+void __spi_context_make(__spi_context_t *ctx, void *stack, size_t size,
+	void (*entry)(void *), void *arg){
+    getcontext(&ctx->ctx_uc);
+    ctx->ctx_uc.uc_stack.ss_sp = stack;
+    ctx->ctx_uc.uc_stack.ss_size = size;
+    ctx->ctx_uc.uc_link = NULL;
+    ctx->ctx_entry = entry;
+    ctx->ctx_arg = arg;
+    makecontext(&ctx->ctx_uc, spi_context_start, 0);
+}
+
+void __spi_context_switch(__spi_context_t *from, __spi_context_t *to){
+    __spi_context_next = to;
+    swapcontext(&from->ctx_uc, &to->ctx_uc);
+}
+
+#endif
+
+void *__spi_stack_alloc(size_t *size){
+    size_t	page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t	len = (*size + page - 1) & ~(page - 1);
+    char	*base;
+
+    base = mmap(NULL, len + page, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED)
+	return NULL;
+
+    // overflow faults on the guard page instead of corrupting memory
+    if(mprotect(base, page, PROT_NONE) != 0){
+	munmap(base, len + page);
+	return NULL;
+    }
+
+    *size = len;
+
+    return base + page;
+}
+
+void __spi_stack_free(void *stack, size_t size){
+    size_t	page = (size_t)sysconf(_SC_PAGESIZE);
+
+    munmap((char *)stack - page, size + page);
+}
+
@@ -13,8 +13,16 @@
 #include <assert.h>
 #include <unistd.h>
 
+#include <time.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#if !defined(__x86_64__) && !defined(__aarch64__)
+#include <ucontext.h>
+#endif
 
 #ifdef __cplusplus
 extern "C"{
@@ -22,6 +30,10 @@ extern "C"{
 
 #define ASSERT	    assert
 
+// keep data written by different threads on their own cache lines
+#define kSPI_CACHELINE	    64
+#define __spi_cacheline	    __attribute__((aligned(kSPI_CACHELINE)))
+
 // condition variable, used internally
 typedef struct __spi_convar_data{
     pthread_mutex_t	cv_mutex;
@@ -83,8 +95,12 @@ static inline int __spi_convar_timedwait(__spi_convar_t *cv, uint32_t ms){
 
     gettimeofday(&tv, NULL);
 
-    ts.tv_sec = tv.tv_sec;
-    ts.tv_nsec = (tv.tv_usec + ms) * 1000;
+    ts.tv_sec = tv.tv_sec + ms / 1000;
+    ts.tv_nsec = (tv.tv_usec + (ms % 1000) * 1000) * 1000;
+    if(ts.tv_nsec >= 1000000000){
+	ts.tv_sec++;
+	ts.tv_nsec -= 1000000000;
+    }
 
     pthread_mutex_lock(&cv->cv_mutex);
     if(cv->cv_count == 0){
@@ -99,6 +115,97 @@ static inline int __spi_convar_timedwait(__spi_convar_t *cv, uint32_t ms){
     return 0;
 }
 
+// spin then park, used internally by workers.
+//
+// owner: prepare, check its queues again, then park or cancel.
+// others: make events visible first, then unpark. unpark only reads the
+// state unless owner is parked, so a running owner costs no syscall.
+//
+// an owner waiting in a poller instead sets pk_fd to an eventfd watched
+// by it, unpark writes that then.
+enum{
+    kSPI_PARKER_RUNNING = 0,
+    kSPI_PARKER_PARKED,
+};
+
+typedef struct __spi_parker{
+    int			pk_state;
+    int			pk_fd;	    // eventfd to write on unpark, -1 for futex
+}__spi_parker_t;
+
+static inline void spi_cpu_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __sync_synchronize();
+#endif
+}
+
+static inline int __spi_parker_init(__spi_parker_t *pk){
+    pk->pk_state = kSPI_PARKER_RUNNING;
+    pk->pk_fd = -1;
+    return 0;
+}
+
+static inline int __spi_parker_fini(__spi_parker_t *pk){
+    return 0;
+}
+
+// full barrier, owner checks its queues after it
+static inline void __spi_parker_prepare(__spi_parker_t *pk){
+    __atomic_store_n(&pk->pk_state, kSPI_PARKER_PARKED, __ATOMIC_SEQ_CST);
+}
+
+static inline void __spi_parker_cancel(__spi_parker_t *pk){
+    __atomic_store_n(&pk->pk_state, kSPI_PARKER_RUNNING, __ATOMIC_RELAXED);
+}
+
+// sleep until unpark or timeout, ms < 0 for ever
+static inline int __spi_parker_park(__spi_parker_t *pk, int ms){
+    struct timespec ts, *pts = NULL;
+
+    if(ms >= 0){
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	pts = &ts;
+    }
+
+    while(__atomic_load_n(&pk->pk_state, __ATOMIC_ACQUIRE) == kSPI_PARKER_PARKED){
+	if(syscall(SYS_futex, &pk->pk_state, FUTEX_WAIT_PRIVATE,
+		    kSPI_PARKER_PARKED, pts, NULL, 0) != 0){
+	    if(errno == ETIMEDOUT)
+		break;
+	}
+    }
+
+    __atomic_store_n(&pk->pk_state, kSPI_PARKER_RUNNING, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+// caller has published its events with a full barrier
+static inline int __spi_parker_unpark(__spi_parker_t *pk){
+    uint64_t	one = 1;
+    int		fd;
+
+    if(__atomic_load_n(&pk->pk_state, __ATOMIC_SEQ_CST) != kSPI_PARKER_PARKED)
+	return 0;
+
+    if(__sync_bool_compare_and_swap(&pk->pk_state, kSPI_PARKER_PARKED,
+		kSPI_PARKER_RUNNING)){
+	fd = __atomic_load_n(&pk->pk_fd, __ATOMIC_RELAXED);
+	if(fd < 0){
+	    syscall(SYS_futex, &pk->pk_state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}else if(write(fd, &one, sizeof(one)) < 0){
+	    // counter is full, poller wakes anyway
+	}
+    }
+
+    return 0;
+}
+
 // OS independ interface
 
 typedef pthread_t		spi_thread_t;
@@ -111,6 +218,58 @@ static inline int spi_thread_destroy(spi_thread_t thrd){
     return pthread_cancel(thrd);
 }
 
+static inline void spi_thread_yield(){
+    sched_yield();
+}
+
+static inline int spi_thread_join(spi_thread_t thrd){
+    return pthread_join(thrd, NULL);
+}
+
+// cpu < 0 let it run on any cpu
+int spi_thread_create_on(spi_thread_t *thrd,
+	void *(*thread_routine)(void *), void *data, int cpu);
+
+// online cpus ordered by numa node, return cpus number
+int spi_cpu_layout(int *cpus, int max);
+
+// user space context switch, used by fibers internally. it saves only
+// what a function call must preserve, no system call.
+typedef struct __spi_context{
+    void		*ctx_sp;    // stack pointer, registers saved on top of it
+#if !defined(__x86_64__) && !defined(__aarch64__)
+    ucontext_t		ctx_uc;
+    void		(*ctx_entry)(void *);
+    void		*ctx_arg;
+#endif
+}__spi_context_t;
+
+// the first switch to ctx calls entry(arg), which must never return
+void __spi_context_make(__spi_context_t *ctx, void *stack, size_t size,
+	void (*entry)(void *), void *arg);
+void __spi_context_switch(__spi_context_t *from, __spi_context_t *to);
+
+// stack above a guard page, size is rounded up to whole pages
+void *__spi_stack_alloc(size_t *size);
+void __spi_stack_free(void *stack, size_t size);
+
+
+typedef pthread_mutex_t		spi_mutex_t;
+static inline int spi_mutex_init(spi_mutex_t *mtx){
+    return pthread_mutex_init(mtx, NULL);
+}
+
+static inline int spi_mutex_fini(spi_mutex_t *mtx){
+    return pthread_mutex_destroy(mtx);
+}
+
+static inline int spi_mutex_lock(spi_mutex_t *mtx){
+    return pthread_mutex_lock(mtx);
+}
+
+static inline int spi_mutex_unlock(spi_mutex_t *mtx){
+    return pthread_mutex_unlock(mtx);
+}
 
 typedef pthread_spinlock_t	spi_spinlock_t;
 static inline int spi_spin_init(spi_spinlock_t *lock){
@@ -133,6 +292,15 @@ static inline int spi_spin_trylock(spi_spinlock_t *lock){
     return pthread_spin_trylock(lock);
 }
 
+// monotonic clock in nanoseconds
+static inline uint64_t spi_time_now(){
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 // use by edp_loop internally.
 static inline void __spi_sleep(int second){
     sleep(second);
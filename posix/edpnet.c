@@ -35,26 +35,25 @@ typedef struct edpnet_data{
     struct list_head	ed_socks;
     struct list_head	ed_servs;
 
-    mcache_t		ed_evcache;
+    emit_class_t	ed_sockclass;	// handlers of all socks
 }edpnet_data_t;
 
 static edpnet_data_t	__edpnet_data = {};
 
-static inline edp_event_t * edpnet_alloc_event(){
+// from the event pool: an eio thread allocates, a worker frees
+static inline edp_event_t * edpnet_alloc_event(short type){
     edpnet_data_t   *ed = &__edpnet_data;
 
     if(!ed->ed_init)
 	return NULL;
 
-    return (edp_event_t *)mcache_alloc(ed->ed_evcache);
+    return edp_event_alloc(type, kEDP_EVENT_PRIORITY_NORM, 0);
 }
 
 static inline void edpnet_free_event(edp_event_t *ev){
-    edpnet_data_t   *ed = &__edpnet_data;
-
-    ASSERT(ed->ed_init);
+    ASSERT(__edpnet_data.ed_init);
 
-    mcache_free(ed->ed_evcache, ev);
+    edp_event_free(ev);
 }
 
 static int set_nonblock(int sock){
@@ -111,6 +110,8 @@ const char* edpnet_ntop(int type, const void *src, char *dst, int len){
 //};
 #define kEDPNET_SOCK_STATUS_WRITE	0x0100
 #define kEDPNET_SOCK_STATUS_READ	0x0200
+#define kEDPNET_SOCK_STATUS_WRITING	0x0400	// edpnet_sock_write in write(2)
+#define kEDPNET_SOCK_STATUS_REWRITE	0x0800	// EPOLLOUT came meanwhile
 
 enum edpnet_sock_handler{
     kEDPNET_SOCK_EPOLLOUT = 0,
@@ -178,6 +179,8 @@ static inline void sock_write_next(struct edpnet_sock *s, int drain){
 	spi_spin_lock(&s->es_lock);
 	// no more pending write ios
 	if(s->es_pendios <= 0){
+	    // under the lock, or a write queued meanwhile waits forever
+	    s->es_status &= ~kEDPNET_SOCK_STATUS_WRITE;
 	    spi_spin_unlock(&s->es_lock);
 	    nowrite = 1;
 	    break;
@@ -207,10 +210,6 @@ static inline void sock_write_next(struct edpnet_sock *s, int drain){
     }
 
     if((nowrite)&&(!drain)){
-	spi_spin_lock(&s->es_lock);
-	s->es_status &= ~kEDPNET_SOCK_STATUS_WRITE;
-	spi_spin_unlock(&s->es_lock);
-	
 	// call data drain callback pfn
 	s->es_cbs->data_drain(s, s->es_data);
     }
@@ -219,6 +218,7 @@ static inline void sock_write_next(struct edpnet_sock *s, int drain){
 static int edpnet_sock_epollout_handler(emit_t em, edp_event_t *ev){
     struct edpnet_sock	*s;
     ioctx_t		*ioc = NULL;
+    int			ret;
 
     s = emit_get(em);
     ASSERT(s != NULL);
@@ -233,15 +233,28 @@ static int edpnet_sock_epollout_handler(emit_t em, edp_event_t *ev){
 
     }else if(s->es_status & kEDPNET_SOCK_STATUS_WRITE){
         spi_spin_lock(&s->es_lock);
-	if(s->es_write != NULL){
-	    
-	    // current write io is oky
+	if(s->es_status & kEDPNET_SOCK_STATUS_WRITING){
+	    // edpnet_sock_write owns es_write now, it dispatches us again
+	    s->es_status |= kEDPNET_SOCK_STATUS_REWRITE;
+	    spi_spin_unlock(&s->es_lock);
+	}else if(s->es_write != NULL){
+	    // current write io got EAGAIN, try it again
 	    ioc = s->es_write;
+	    spi_spin_unlock(&s->es_lock);
+
+	    ret = sock_write(s->es_sock, ioc);
+	    if(ret == 0)
+		return 0;
+
+	    spi_spin_lock(&s->es_lock);
 	    s->es_write = NULL;
 	    spi_spin_unlock(&s->es_lock);
 
 	    // call current write io's callbacks
-	    ioc->ioc_iocb(s, ioc, 0);
+	    ioc->ioc_iocb(s, ioc, ret);
+
+	    // write next io to sock
+	    sock_write_next(s, 1);
 	}else{
 	    spi_spin_unlock(&s->es_lock);
 	    
@@ -258,7 +271,6 @@ static int edpnet_sock_epollout_handler(emit_t em, edp_event_t *ev){
 
 static int edpnet_sock_epollin_handler(emit_t em, edp_event_t *ev){
     struct edpnet_sock	*s;
-    int			ready = 0;
 
     s = emit_get(em);
     ASSERT(s != NULL);
@@ -267,15 +279,12 @@ static int edpnet_sock_epollin_handler(emit_t em, edp_event_t *ev){
 	
     // data come in
     spi_spin_lock(&s->es_lock);
-    if(!(s->es_status & kEDPNET_SOCK_STATUS_READ)){
-	s->es_status |= kEDPNET_SOCK_STATUS_READ;
-	ready = 1;
-    }
+    s->es_status |= kEDPNET_SOCK_STATUS_READ;
     spi_spin_unlock(&s->es_lock);
 
-    // call user regiested callback:data_ready
-    if(ready)
-	s->es_cbs->data_ready(s, s->es_data);
+    // call user regiested callback:data_ready, on every edge: a reader
+    // which got EAGAIN just before it would wait for the next one forever
+    s->es_cbs->data_ready(s, s->es_data);
     
     return 0;
 }
@@ -316,49 +325,77 @@ static void edpnet_sock_done(edp_event_t *ev, void *data, int errcode){
     edpnet_free_event(ev);
 }
 
-static int edpnet_sock_dispatch(struct edpnet_sock *sock, enum edpnet_sock_handler type){
+static int edpnet_sock_prepare(struct edpnet_sock *sock,
+	enum edpnet_sock_handler type, edp_event_t **evp){
     edp_event_t	    *ev;
     int		    ret;
 
     ASSERT(sock != NULL);
 
-    ev = edpnet_alloc_event();
+    ev = edpnet_alloc_event((short)type);
     if(ev == NULL){
 	log_warn("alloc event fail\n");
 	return -ENOMEM;
     }
-    edp_event_init(ev, (short)type, kEDP_EVENT_PRIORITY_NORM);
 
-    ret = emit_dispatch(sock->es_emit, ev, edpnet_sock_done, NULL);
-    if(ret != 0){
-	log_warn("dispatch event fail:%d\n", ret);
+    ret = emit_prepare(sock->es_emit, ev, edpnet_sock_done, NULL);
+    if(ret == -EALREADY){
+	// one of the type is queued still, it handles this edge too
+	edpnet_free_event(ev);
+	return ret;
+    }else if(ret != 0){
+	log_warn("prepare event fail:%d\n", ret);
 	edpnet_free_event(ev);
 	return -1;
     }
 
+    *evp = ev;
+
     return 0;
 }
 
+static int edpnet_sock_dispatch(struct edpnet_sock *sock, enum edpnet_sock_handler type){
+    edp_event_t	    *ev;
+    int		    ret;
+
+    ret = edpnet_sock_prepare(sock, type, &ev);
+    if(ret != 0){
+	return ret;
+    }
+
+    return emit_submit(ev);
+}
+
 static void sock_worker_cb(uint32_t events, void *data){
     struct edpnet_sock	*s = (struct edpnet_sock *)data;
+    edp_event_t		*evs[4];
+    int			num = 0;
 
     ASSERT(s != NULL);
 
     if(events & EPOLLOUT){
-	edpnet_sock_dispatch(s, kEDPNET_SOCK_EPOLLOUT);
+	if(edpnet_sock_prepare(s, kEDPNET_SOCK_EPOLLOUT, &evs[num]) == 0)
+	    num++;
     }
 
     if(events & (EPOLLPRI | EPOLLIN)){
-	edpnet_sock_dispatch(s, kEDPNET_SOCK_EPOLLIN);
+	if(edpnet_sock_prepare(s, kEDPNET_SOCK_EPOLLIN, &evs[num]) == 0)
+	    num++;
     }
 
     if(events & EPOLLERR){
-	edpnet_sock_dispatch(s, kEDPNET_SOCK_EPOLLERR);
+	if(edpnet_sock_prepare(s, kEDPNET_SOCK_EPOLLERR, &evs[num]) == 0)
+	    num++;
     }
     
     if(events & EPOLLHUP){
-	edpnet_sock_dispatch(s, kEDPNET_SOCK_EPOLLHUP);
+	if(edpnet_sock_prepare(s, kEDPNET_SOCK_EPOLLHUP, &evs[num]) == 0)
+	    num++;
     }
+
+    // one queue push and one wakeup for all of them
+    if(num > 0)
+	emit_dispatch_batch(evs, num);
 }
 
 static int sock_init(edpnet_sock_t sock){
@@ -414,15 +451,21 @@ int edpnet_sock_create(edpnet_sock_t *sock, edpnet_sock_cbs_t *cbs, void *data){
     }
     memset(s, 0, sizeof(*s));
 
-    ret = emit_create(s, &s->es_emit);
+    ret = emit_create_class(ed->ed_sockclass, s, &s->es_emit);
     if(ret !=0 ){
 	log_warn("create emit fail:%d\n", ret);
+	mheap_free(s);
+	return ret;
+    }
+
+    // socket events never run at the same time and keep epoll order
+    ret = emit_strand(s->es_emit, kEDP_EVENT_PRIORITY_NORM);
+    if(ret != 0){
+	log_warn("strand emit fail:%d\n", ret);
+	emit_destroy(s->es_emit);
+	mheap_free(s);
 	return ret;
     }
-    emit_add_handler(s->es_emit, kEDPNET_SOCK_EPOLLOUT, edpnet_sock_epollout_handler);
-    emit_add_handler(s->es_emit, kEDPNET_SOCK_EPOLLIN, edpnet_sock_epollin_handler);
-    emit_add_handler(s->es_emit, kEDPNET_SOCK_EPOLLERR, edpnet_sock_epollerr_handler);
-    emit_add_handler(s->es_emit, kEDPNET_SOCK_EPOLLHUP, edpnet_sock_epollhup_handler);
 
     s->es_sock = socket(PF_INET, SOCK_STREAM, 0);
     if(s->es_sock < 0){
@@ -516,7 +559,7 @@ int edpnet_sock_connect(edpnet_sock_t sock, edpnet_addr_t *addr){
 
 int edpnet_sock_write(edpnet_sock_t sock, ioctx_t *io, edpnet_writecb cb){
     struct edpnet_sock	*s = sock;
-    int			ret = 0;
+    int			ret = 0, again;
 
     ASSERT((io != NULL) && (io->ioc_io_type == kIOCTX_IO_TYPE_SOCK));
 
@@ -526,23 +569,30 @@ int edpnet_sock_write(edpnet_sock_t sock, ioctx_t *io, edpnet_writecb cb){
     spi_spin_lock(&s->es_lock);
     if((!(s->es_status & kEDPNET_SOCK_STATUS_WRITE)) && (s->es_write == NULL)){
 	s->es_write = io;
-	s->es_status |= kEDPNET_SOCK_STATUS_WRITE;
+	s->es_status |= kEDPNET_SOCK_STATUS_WRITE | kEDPNET_SOCK_STATUS_WRITING;
 	spi_spin_unlock(&s->es_lock);
 
 	ret = sock_write(s->es_sock, io);
-	if(ret != 0){
-	    // ret < 0, write fail; ret > 0, data size ret have been writed.
 
-	    spi_spin_lock(&s->es_lock);
+	spi_spin_lock(&s->es_lock);
+	s->es_status &= ~kEDPNET_SOCK_STATUS_WRITING;
+	again = s->es_status & kEDPNET_SOCK_STATUS_REWRITE;
+	s->es_status &= ~kEDPNET_SOCK_STATUS_REWRITE;
+	if(ret != 0)
 	    s->es_write = NULL;
-	    spi_spin_unlock(&s->es_lock);
+	spi_spin_unlock(&s->es_lock);
 
+	if(ret != 0){
+	    // ret < 0, write fail; ret > 0, data size ret have been writed.
 	    // write fail or success, callback to caller
 	    cb(sock, io, ret);
 
 	    // write another pending write io
 	    edpnet_sock_dispatch(s, kEDPNET_SOCK_EPOLLOUT);
 //	    sock_write_next(s, 0);
+	}else if(again){
+	    // write return EAGAIN, but the sock drained while we were at it
+	    edpnet_sock_dispatch(s, kEDPNET_SOCK_EPOLLOUT);
 	}else{
 	    // write return EAGAIN or EWOULDBLOCK
 	    // do nothing
@@ -560,12 +610,14 @@ int edpnet_sock_write(edpnet_sock_t sock, ioctx_t *io, edpnet_writecb cb){
 int edpnet_sock_read(edpnet_sock_t sock, ioctx_t *io){
     struct edpnet_sock	*s = sock;
     int			ready = 0;
-    ssize_t		ret = -1;
+    ssize_t		ret = -EAGAIN;
 
     ASSERT((io != NULL) && (io->ioc_io_type == kIOCTX_IO_TYPE_SOCK));
 
+    // cleared before read(2), an edge coming after it sets it again
     spi_spin_lock(&s->es_lock);
     if(s->es_status & kEDPNET_SOCK_STATUS_READ){
+	s->es_status &= ~kEDPNET_SOCK_STATUS_READ;
 	ready = 1;
     }
     spi_spin_unlock(&s->es_lock);
@@ -582,17 +634,22 @@ int edpnet_sock_read(edpnet_sock_t sock, ioctx_t *io){
 
 	default:
 	    log_warn("ioctx:0x%x type unkown:%d\n", (uint64_t) io, io->ioc_data_type);
+	    errno = EINVAL;
 	    ret = -1;
 	}
 
 	if(ret < 0){
 	    if((errno == EAGAIN) || (errno == EWOULDBLOCK)){
 		ret = -EAGAIN;
+	    }else{
+		ret = -errno;
 	    }
+	}else{
+	    // more may be left, the next read tries too
 	    spi_spin_lock(&s->es_lock);
-	    s->es_status &= ~kEDPNET_SOCK_STATUS_READ;
+	    s->es_status |= kEDPNET_SOCK_STATUS_READ;
 	    spi_spin_unlock(&s->es_lock);
-	}else{
+
 	    io->ioc_bytes = ret;
 	}
     }
@@ -765,8 +822,9 @@ int edpnet_serv_listen(edpnet_serv_t serv, edpnet_addr_t *addr){
  */
 int edpnet_init(){
     edpnet_data_t	*ed = &__edpnet_data;
+    int			eios = __edp_getconf()->ec_eio_threads;
 
-    if(eio_init(1) != 0){
+    if(eio_init((eios > 0) ? eios : 1) != 0){
 	log_warn("init eio fail\n");
 	return -1;
     }
@@ -776,13 +834,20 @@ int edpnet_init(){
 
     spi_spin_init(&ed->ed_lock);
 
-    if(mcache_create(sizeof(edp_event_t), sizeof(int), MCACHE_FLAGS_NOWAIT,
-		&ed->ed_evcache)){
+    if(emit_class_create(kEDPNET_SOCK_EPOLLHUP + 1, &ed->ed_sockclass) != 0){
 	spi_spin_fini(&ed->ed_lock);
 	eio_fini();
 
 	return -1;
     }
+    emit_class_add_handler(ed->ed_sockclass, kEDPNET_SOCK_EPOLLOUT, edpnet_sock_epollout_handler);
+    emit_class_add_handler(ed->ed_sockclass, kEDPNET_SOCK_EPOLLIN, edpnet_sock_epollin_handler);
+    emit_class_add_handler(ed->ed_sockclass, kEDPNET_SOCK_EPOLLERR, edpnet_sock_epollerr_handler);
+    emit_class_add_handler(ed->ed_sockclass, kEDPNET_SOCK_EPOLLHUP, edpnet_sock_epollhup_handler);
+
+    // handlers look at the sock's state, one queued edge is as good as more
+    emit_class_coalesce(ed->ed_sockclass, kEDPNET_SOCK_EPOLLOUT);
+    emit_class_coalesce(ed->ed_sockclass, kEDPNET_SOCK_EPOLLIN);
 
     ed->ed_init = 1;
 
@@ -796,7 +861,7 @@ int edpnet_fini(){
 
     ed->ed_init = 0;
     spi_spin_fini(&ed->ed_lock);
-    mcache_destroy(ed->ed_evcache);
+    emit_class_destroy(ed->ed_sockclass);
 
     return 0;
 }
@@ -13,6 +13,7 @@
 #include "atomic.h"
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #define EPOLL_MAX_EVENTS	    32
 
@@ -28,7 +29,11 @@ typedef struct eio_worker{
     atomic_t		iwk_fds;    // fds watch by epoll
 
     uint64_t		iwk_events; // have processed io events
-}eio_worker_t;
+
+    int			iwk_wakefd; // eventfd, interrupts epoll_wait
+    int			iwk_break;  // asked to return
+    struct epoll_event	iwk_evbuf[EPOLL_MAX_EVENTS];
+}__spi_cacheline eio_worker_t;
    
 // event used by eio
 typedef struct eio_event{
@@ -49,6 +54,7 @@ typedef struct eio_data{
     spi_spinlock_t	iod_lock;
 
     int			iod_round;  // round-robin
+    int			iod_caller; // edp_loop caller runs iod_workers[0]
     
     mcache_t		iod_evcache;
     hset_t		iod_fds;
@@ -182,57 +188,187 @@ static int eio_fini_tls(eio_worker_t *iwk){
     return 0;
 }
 
-static void *eio_worker_routine(void *data){
-    eio_worker_t	*iwk = (eio_worker_t *)data;
-    struct epoll_event	*events, *ev;
+// one epoll wait of up to ms, return io events handled
+static int eio_worker_poll(eio_worker_t *iwk, int ms){
+    struct epoll_event	*ev;
     eio_event_t		*ioe;
-    int			msz;
+    uint64_t		val;
     int			evcnt;
-    int			i;
+    int			i, num = 0;
+
+    evcnt = epoll_wait(iwk->iwk_epoll, iwk->iwk_evbuf, EPOLL_MAX_EVENTS, ms);
+    if(evcnt < 0){
+	if(errno == EINTR)
+	    return 0;
+
+	log_warn("epoll wait fail:%d\n", errno);
+	return -errno;
+    }
+
+    for(i = 0; i < evcnt; i++){
+	ev = &(iwk->iwk_evbuf[i]);
+	ioe = (eio_event_t *)ev->data.ptr;
+
+	// wakeup of the edp_loop caller
+	if(ioe == NULL){
+	    if(read(iwk->iwk_wakefd, &val, sizeof(val)) < 0){
+		// drained by an earlier round
+	    }
+	    continue;
+	}
+
+	// call fd bind callback function
+	ioe->ioe_cb(ev->events, ioe->ioe_data);
+	iwk->iwk_events ++;
+	num++;
+    }
+
+    return num;
+}
+
+// epoll & wakeup eventfd of a poller
+static int eio_wake_init(eio_worker_t *iwk){
+    struct epoll_event	ev;
+    int			ret;
+
+    ret = eio_init_tls(iwk);
+    if(ret != 0){
+	return ret;
+    }
+
+    iwk->iwk_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(iwk->iwk_wakefd < 0){
+	ret = -errno;
+	log_warn("create eventfd fail:%d\n", errno);
+	eio_fini_tls(iwk);
+	return ret;
+    }
+
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL;
+    if(epoll_ctl(iwk->iwk_epoll, EPOLL_CTL_ADD, iwk->iwk_wakefd, &ev) != 0){
+	ret = -errno;
+	log_warn("epoll watch eventfd fail:%d\n", errno);
+	close(iwk->iwk_wakefd);
+	iwk->iwk_wakefd = -1;
+	eio_fini_tls(iwk);
+	return ret;
+    }
+
+    return 0;
+}
+
+static void eio_wake_fini(eio_worker_t *iwk){
+    eio_fini_tls(iwk);
+    if(iwk->iwk_wakefd >= 0){
+	close(iwk->iwk_wakefd);
+	iwk->iwk_wakefd = -1;
+    }
+}
+
+static void *eio_worker_routine(void *data){
+    eio_worker_t	*iwk = (eio_worker_t *)data;
     int			ret = -1;
 
     ASSERT(iwk != NULL);
 
-    ret = eio_init_tls(iwk);
+    ret = eio_wake_init(iwk);
     if(ret != 0){
 	log_warn("init worker fail:%d\n", ret);
 	return (void *)-1;
     }
 
-    msz = sizeof(*events) * EPOLL_MAX_EVENTS;
-    events = mheap_alloc(msz);
-    if(events == NULL){
-	log_warn("alloc memory for epoll wait fail!\n");
-	return (void *)(-ENOMEM);
-    }
-    memset(events, 0, msz);
-
     // yes, I'm working
     __spi_convar_signal(&iwk->iwk_convar);
 
-    while(iwk->iwk_init){
-	evcnt = epoll_wait(iwk->iwk_epoll, events, EPOLL_MAX_EVENTS, -1);
-	if(evcnt < 0){
-	    log_warn("epoll wait fail:%d\n", errno);
-	    ret = -errno;
+    while(!iwk->iwk_break){
+	if(eio_worker_poll(iwk, -1) < 0)
 	    break;
-	}
+    }
 
-	for(i = 0; i < evcnt; i++){
-	    ev = &(events[i]);
-	    ioe = (eio_event_t *)ev->data.ptr;
-	    ASSERT(ioe != NULL);
+    // edpnet frees its events here too
+    edp_event_drain();
 
-	    // call fd bind callback function
-	    ioe->ioe_cb(ev->events, ioe->ioe_data);
-	    iwk->iwk_events ++;
-	}
-//	memset(events, 0, sizeof(*events)*evcnt);
+    return NULL;
+}
+
+// wake the thread through its eventfd & wait for it to return
+static void eio_worker_stop(eio_data_t *iod, eio_worker_t *iwk){
+    uint64_t	    one = 1;
+
+    if((iwk == &iod->iod_workers[0]) && iod->iod_caller){
+	eio_wake_fini(iwk);
+	return ;
     }
 
-    eio_fini_tls(iwk);
+    iwk->iwk_break = 1;
+    if(write(iwk->iwk_wakefd, &one, sizeof(one)) < 0){
+	log_warn("wake eio thread fail:%d\n", errno);
+    }
 
-    return NULL;
+    spi_thread_join(iwk->iwk_thread);
+    eio_wake_fini(iwk);
+    __spi_convar_fini(&iwk->iwk_convar);
+}
+
+static inline eio_worker_t *eio_caller(){
+    eio_data_t	    *iod = get_data();
+
+    if((iod == NULL) || (!iod->iod_caller)){
+	return NULL;
+    }
+
+    return &iod->iod_workers[0];
+}
+
+int eio_poll(int ms){
+    eio_worker_t    *iwk = eio_caller();
+
+    if(iwk == NULL){
+	return -EINVAL;
+    }
+
+    return eio_worker_poll(iwk, ms);
+}
+
+int eio_wakefd(){
+    eio_worker_t    *iwk = eio_caller();
+
+    return (iwk == NULL) ? -1 : iwk->iwk_wakefd;
+}
+
+int eio_loop(){
+    eio_worker_t    *iwk = eio_caller();
+    int		    ret = 0;
+
+    if(iwk == NULL){
+	return -EINVAL;
+    }
+
+    while(!iwk->iwk_break){
+	ret = eio_worker_poll(iwk, -1);
+	if(ret < 0)
+	    break;
+    }
+    iwk->iwk_break = 0;
+
+    return ret < 0 ? ret : 0;
+}
+
+int eio_loop_break(){
+    eio_worker_t    *iwk = eio_caller();
+    uint64_t	    one = 1;
+
+    if(iwk == NULL){
+	return -EINVAL;
+    }
+
+    iwk->iwk_break = 1;
+    if(write(iwk->iwk_wakefd, &one, sizeof(one)) < 0){
+	return -errno;
+    }
+
+    return 0;
 }
 
 int eio_init(int thread_num){
@@ -244,7 +380,7 @@ int eio_init(int thread_num){
 
     msz = sizeof(*iod) + sizeof(*iwk)*thread_num;
 
-    iod = mheap_alloc(msz);
+    iod = mheap_alloc_aligned(msz, kSPI_CACHELINE);
     if(iod == NULL){
 	log_warn("no enough memory!\n");
 	return -ENOMEM;
@@ -265,8 +401,20 @@ int eio_init(int thread_num){
 	goto exit_hset;
     }
 
+    iod->iod_caller = (__edp_getconf()->ec_loop & kEDP_LOOP_EIO) ? 1 : 0;
+
     for(i = 0; i < thread_num; i++){
 	iwk = &(iod->iod_workers[i]);
+	iwk->iwk_wakefd = -1;
+
+	if((i == 0) && iod->iod_caller){
+	    ret = eio_wake_init(iwk);
+	    if(ret != 0){
+		log_warn("init loop poller fail:%d\n", ret);
+		goto exit_thread;
+	    }
+	    continue;
+	}
 	
 	ret = __spi_convar_init(&iwk->iwk_convar);
 	if(ret != 0){
@@ -274,7 +422,8 @@ int eio_init(int thread_num){
 	    goto exit_thread;
 	}
 
-	ret = spi_thread_create(&iwk->iwk_thread, eio_worker_routine, iwk);
+	ret = spi_thread_create_on(&iwk->iwk_thread, eio_worker_routine, iwk,
+		__edp_thread_cpu(kEDP_THREAD_EIO, i));
 	if(ret != 0){
 	    log_warn("create thread fail:%d\n", ret);
 	    __spi_convar_fini(&iwk->iwk_convar);
@@ -297,10 +446,8 @@ int eio_init(int thread_num){
     return 0;
 
 exit_thread:
-    for(; i >= 0; i--){
-	iwk = &(iod->iod_workers[i]);
-	spi_thread_destroy(iwk->iwk_thread);
-	__spi_convar_fini(&iwk->iwk_convar);
+    for(i--; i >= 0; i--){
+	eio_worker_stop(iod, &(iod->iod_workers[i]));
     }
 
     hset_destroy(iod->iod_fds);
@@ -329,8 +476,7 @@ int eio_fini(){
 
     for(i = 0; i < iod->iod_num; i++){
 	iwk = &(iod->iod_workers[i]);
-	spi_thread_destroy(iwk->iwk_thread);
-	__spi_convar_fini(&iwk->iwk_convar);
+	eio_worker_stop(iod, iwk);
     }
 
     hset_destroy(iod->iod_fds);
@@ -20,6 +20,14 @@ int eio_delfd(int fd);
 int eio_init(int thread_num);
 int eio_fini();
 
+// eio thread 0 is run by the edp_loop caller with kEDP_LOOP_EIO:
+// eio_loop polls until eio_loop_break, eio_poll does one round of up to
+// ms (< 0 for ever) and eio_wakefd, an eventfd, interrupts it.
+int eio_loop();
+int eio_loop_break();
+int eio_poll(int ms);
+int eio_wakefd();
+
 #ifdef __cplusplus
 }
 #endif
@@ -92,6 +92,18 @@ void *mheap_alloc(size_t size){
     return malloc(size);
 }
 
+void *mheap_alloc_aligned(size_t size, size_t align){
+    void    *ptr;
+
+    if(align < sizeof(void *))
+	align = sizeof(void *);
+
+    if(posix_memalign(&ptr, align, size) != 0)
+	return NULL;
+
+    return ptr;
+}
+
 void mheap_free(void *ptr){
     return free(ptr);
 }
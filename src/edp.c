@@ -7,16 +7,117 @@
 #include "worker.h"
 #include "emitter.h"
 #include "edpnet.h"
+#include "eio.h"
 
 #include "logger.h"
 #include "mcache.h"
 #include "hset.h"
 
+#define EDP_CPU_MAX	    1024
+
+static edp_conf_t   __edp_conf = {};
+
+static int	    __edp_cpus[EDP_CPU_MAX];	// cpus ordered by numa node
+static int	    __edp_cpunum = 0;
+
+// kEDP_AFFINITY_USER cpus, copied from the conf at edp_init
+static int	    __edp_worker_cpus[EDP_CPU_MAX];
+static int	    __edp_worker_cpunum = 0;
+static int	    __edp_eio_cpus[EDP_CPU_MAX];
+static int	    __edp_eio_cpunum = 0;
+
+static int	    __edp_break = 0;		// kEDP_LOOP_SLEEP
+static __spi_convar_t	__edp_sleep;
+
+const edp_conf_t *__edp_getconf(void){
+    return &__edp_conf;
+}
+
+int __edp_thread_cpu(int kind, int index){
+    edp_conf_t	*conf = &__edp_conf;
+    int		*cpus;
+    int		num;
+
+    switch(conf->ec_affinity){
+	case kEDP_AFFINITY_NUMA:
+	    if(__edp_cpunum <= 0)
+		return -1;
+
+	    // eio threads first, workers fed by them follow on the same node
+	    if(kind == kEDP_THREAD_WORKER)
+		index += conf->ec_eio_threads;
+
+	    return __edp_cpus[index % __edp_cpunum];
+
+	case kEDP_AFFINITY_USER:
+	    if(kind == kEDP_THREAD_WORKER){
+		cpus = conf->ec_worker_cpus;
+		num  = __edp_worker_cpunum;
+	    }else{
+		cpus = conf->ec_eio_cpus;
+		num  = __edp_eio_cpunum;
+	    }
+
+	    if((cpus == NULL) || (index >= num))
+		return -1;
+
+	    return cpus[index];
+
+	default:
+	    return -1;
+    }
+}
+
+// keep a copy of cnt cpus, threads past EDP_CPU_MAX run on any cpu
+static int *edp_copy_cpus(int *copy, int *num, const int *cpus, int cnt){
+    if((cpus == NULL) || (cnt <= 0)){
+	*num = 0;
+	return NULL;
+    }
+
+    *num = (cnt < EDP_CPU_MAX) ? cnt : EDP_CPU_MAX;
+    memcpy(copy, cpus, sizeof(int) * (*num));
+
+    return copy;
+}
+
 int edp_init(int thread_num){
+    edp_conf_t	conf;
+
+    edp_conf_init(&conf, thread_num);
+
+    return edp_init_conf(&conf);
+}
+
+int edp_init_conf(edp_conf_t *conf){
     int	    ret = -1;
 
+    ASSERT(conf != NULL);
+
+    __edp_conf = *conf;
+    if(__edp_conf.ec_eio_threads <= 0)
+	__edp_conf.ec_eio_threads = 1;
+
+    if(__edp_conf.ec_affinity == kEDP_AFFINITY_NUMA)
+	__edp_cpunum = spi_cpu_layout(__edp_cpus, EDP_CPU_MAX);
+
+    // workers edp_workers_resize starts later are pinned too
+    if(__edp_conf.ec_affinity == kEDP_AFFINITY_USER){
+	__edp_conf.ec_worker_cpus = edp_copy_cpus(__edp_worker_cpus, &__edp_worker_cpunum,
+		conf->ec_worker_cpus, (conf->ec_worker_max > conf->ec_workers) ?
+		conf->ec_worker_max : conf->ec_workers);
+	__edp_conf.ec_eio_cpus = edp_copy_cpus(__edp_eio_cpus, &__edp_eio_cpunum,
+		conf->ec_eio_cpus, __edp_conf.ec_eio_threads);
+    }
+
+    ret = __spi_convar_init(&__edp_sleep);
+    if(ret != 0){
+	return ret;
+    }
+
     ret = logger_init();
     if(ret != 0){
+	__spi_convar_fini(&__edp_sleep);
 	return ret;
     }
 
@@ -33,7 +134,13 @@ int edp_init(int thread_num){
 	goto exit_hset;
     }
 
-    ret = worker_init(thread_num);
+    ret = __edp_event_init();
+    if(ret != 0){
+	log_warn("init event pool fail:%d\n", ret);
+	goto exit_event;
+    }
+
+    ret = worker_init(&__edp_conf);
     if(ret != 0){
 	log_warn("init worker fail:%d\n", ret);
 	goto exit_worker;
@@ -62,6 +169,9 @@ exit_emit:
     worker_fini();
 
 exit_worker:
+    __edp_event_fini();
+
+exit_event:
     hset_fini();
 
 exit_hset:
@@ -69,17 +179,47 @@ exit_hset:
 
 exit_mcache:
     logger_fini();
+    __spi_convar_fini(&__edp_sleep);
 
     return ret;
 }
 
 int edp_loop(){
 
-    while(1){
-	__spi_sleep(10);
+    switch(__edp_conf.ec_loop){
+	case kEDP_LOOP_EIO:
+	    return eio_loop();
+
+	case kEDP_LOOP_WORKER:
+	    return worker_loop(NULL, -1);
+
+	case kEDP_LOOP_BOTH:
+	    return worker_loop(eio_poll, eio_wakefd());
+
+	default:
+	    while(!__edp_break){
+		__spi_convar_timedwait(&__edp_sleep, 10000);
+	    }
+	    __edp_break = 0;
+	    return 0;
     }
+}
 
-    return 0;
+int edp_loop_break(){
+
+    switch(__edp_conf.ec_loop){
+	case kEDP_LOOP_EIO:
+	    return eio_loop_break();
+
+	case kEDP_LOOP_WORKER:
+	case kEDP_LOOP_BOTH:
+	    return worker_loop_break();
+
+	default:
+	    __edp_break = 1;
+	    __spi_convar_signal(&__edp_sleep);
+	    return 0;
+    }
 }
 
 int edp_fini(){
@@ -90,12 +230,16 @@ int edp_fini(){
 
     worker_fini();
 
+    __edp_event_fini();
+
     hset_fini();
 
     mcache_fini();
 
     logger_fini();
 
+    __spi_convar_fini(&__edp_sleep);
+
     return 0;
 }
 
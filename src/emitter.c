@@ -4,6 +4,7 @@
  */
 
 #include "emitter.h"
+#include "fiber.h"
 
 #include "atomic.h"
 #include "logger.h"
@@ -11,6 +12,30 @@
 
 
 #define	EMIT_INSTANCE_MAGIC	    0xedafedafedaf0000
+#define EMIT_STRAND_BUDGET	    32	// strand events run per turn
+#define EMIT_SHARDS		    64	// registry lists, threads spread over them
+
+#define EMIT_CLASS_PAGE_SHIFT	    4	// handlers of a page, 2 cache lines
+#define EMIT_CLASS_PAGE		    (1 << EMIT_CLASS_PAGE_SHIFT)
+#define EMIT_CLASS_PAGE_MASK	    (EMIT_CLASS_PAGE - 1)
+
+// two level table: type >> shift picks a page, NULL for one of no handlers
+struct emit_class{
+    int			ec_types;   // types are [0, ec_types)
+    int			ec_sealed;  // has emitters, read only
+    int			ec_private; // of one emit_create emitter
+    uint64_t		ec_coalesce;// coalescing types
+
+    emit_handler	*ec_pages[];
+};
+
+// made by emit_strand, most emitters don't need it
+typedef struct emit_strand{
+    mpscq_t		st_mailbox; // strand events, pushed by any thread
+    atomic_t		st_queued;  // strand events not finished yet
+    struct list_head	st_runq;    // grabbed strand events, runner only
+    edp_event_t		st_runner;  // runs the strand on a worker
+}emit_strand_t;
 
 struct edp_emit{
     uint64_t		ee_magic;
@@ -19,19 +44,42 @@ struct edp_emit{
     spi_spinlock_t	ee_lock;
     atomic_t		ee_pendings;  
     struct list_head	ee_node;    // link to emit master
+    int			ee_shard;   // registry shard it is in
+    uint64_t		ee_home;    // of ordered events, see __edp_home
+
+    emit_strand_t	*ee_strand; // events run one at a time in FIFO order
+    int			ee_fiber;   // handlers run on fibers
 
-    emit_handler	ee_handler[kEMIT_EVENT_TYPE_MAX];
+    struct emit_class	*ee_class;  // handlers, NULL for none yet
+    uint64_t		ee_coalesced;// coalescing types with one queued
 
     void		*ee_data;   // owner's data
 };
 
+// one fan out, node events follow it in the same block
+typedef struct emit_pub{
+    edp_event_t		*ep_event;  // published
+    atomic_t		ep_refs;    // nodes not done & holds
+    int			ep_errcode; // first error of a subscriber
+
+    edp_event_t		**ep_evs;   // for emit_dispatch_batch
+    edp_event_t		ep_nodes[];
+}emit_pub_t;
+
+// a part of the registry, threads create emitters mostly in their own
+typedef struct emit_shard{
+    spi_spinlock_t	es_lock;
+    struct list_head	es_emits;
+}__spi_cacheline emit_shard_t;
+
 typedef struct emit_data{
     int			ed_init;
-    spi_spinlock_t	ed_lock;
-    struct list_head	ed_emits;
+    atomic_t		ed_threads; // gives threads their shards
+    emit_shard_t	ed_shards[EMIT_SHARDS];
 }emit_data_t;
 
 static emit_data_t	__emit_data = {};
+static __thread int	__emit_shard = -1;
 
 /*
  * implemetations
@@ -48,11 +96,92 @@ static int emit_check(emit_t em){
     return ee->ee_magic == EMIT_INSTANCE_MAGIC;
 }
 
-static int emit_default_handler(emit_t em, edp_event_t *ev){
-    ASSERT(ev != NULL);
-    
-    log_warn("default watch event, type:%d\n", ev->ev_type);
-    return -ENOENT;
+static inline emit_handler emit_class_lookup(struct emit_class *ec, int type){
+    emit_handler    *page;
+
+    if((ec == NULL) || ((unsigned)type >= (unsigned)ec->ec_types))
+	return NULL;
+
+    page = ec->ec_pages[type >> EMIT_CLASS_PAGE_SHIFT];
+    if(page == NULL)
+	return NULL;
+
+    return page[type & EMIT_CLASS_PAGE_MASK];
+}
+
+static inline int emit_class_types(struct emit_class *ec){
+    return (ec != NULL) ? ec->ec_types : kEMIT_EVENT_TYPE_MAX;
+}
+
+static inline uint64_t emit_coalesce_bit(struct edp_emit *ee, int type){
+    if((ee->ee_class == NULL) || (type < 0) || (type >= kEMIT_COALESCE_TYPE_MAX))
+	return 0;
+
+    return ee->ee_class->ec_coalesce & (1ULL << type);
+}
+
+// its handler starts, later events of the type are queued again
+static inline void emit_coalesce_clear(struct edp_emit *ee, edp_event_t *ev){
+    uint64_t	    bit = emit_coalesce_bit(ee, ev->ev_type);
+
+    if(bit != 0)
+	__atomic_fetch_and(&ee->ee_coalesced, ~bit, __ATOMIC_SEQ_CST);
+}
+
+static int emit_class_set(struct emit_class *ec, int type, emit_handler handler){
+    emit_handler    **page;
+
+    if((type < 0) || (type >= ec->ec_types)){
+	log_warn("event type overflow:%d!\n", type);
+	return -ERANGE;
+    }
+
+    page = &ec->ec_pages[type >> EMIT_CLASS_PAGE_SHIFT];
+    if(*page == NULL){
+	if(handler == NULL)
+	    return 0;
+
+	*page = (emit_handler *)mheap_alloc(sizeof(emit_handler) * EMIT_CLASS_PAGE);
+	if(*page == NULL){
+	    log_warn("not enough memory!\n");
+	    return -ENOMEM;
+	}
+	memset(*page, 0, sizeof(emit_handler) * EMIT_CLASS_PAGE);
+    }
+
+    (*page)[type & EMIT_CLASS_PAGE_MASK] = handler;
+    return 0;
+}
+
+static void emit_class_free(struct emit_class *ec){
+    int		    i;
+
+    for(i = 0; i < (ec->ec_types + EMIT_CLASS_PAGE_MASK) >> EMIT_CLASS_PAGE_SHIFT; i++){
+	if(ec->ec_pages[i] != NULL)
+	    mheap_free(ec->ec_pages[i]);
+    }
+
+    mheap_free(ec);
+}
+
+static void emit_event_call(struct edp_emit *ee, edp_event_t *ev){
+    int		    errcode;
+
+    errcode = emit_class_lookup(ee->ee_class, ev->ev_type)(ee, ev);
+
+//    spi_spin_lock(&eu->ee_lock);
+//    list_del(&ev->ev_edpu);
+//    spi_spin_unlock(&eu->ee_lock);
+    atomic_dec(&ee->ee_pendings);
+
+    edp_event_done(ev, errcode);
+}
+
+// the handler may suspend, the worker goes on meanwhile
+static void emit_fiber_call(void *arg){
+    edp_event_t	    *ev = (edp_event_t *)arg;
+
+    emit_event_call((struct edp_emit *)ev->ev_emit, ev);
 }
 
 static void emit_event_handler(void *emit, struct edp_event *ev){
@@ -62,40 +191,311 @@ static void emit_event_handler(void *emit, struct edp_event *ev){
     ASSERT((emit != NULL) && emit_check(ee));
     ASSERT(ev != NULL);
 
-    if((ev->ev_type < 0) || (ev->ev_type >= kEMIT_EVENT_TYPE_MAX)){
-	log_warn("event type overflow:%d!\n", ev->ev_type);
-	edp_event_done(ev, -ERANGE);
+    emit_coalesce_clear(ee, ev);
+
+    if(ev->ev_flags & kEDP_EVENT_FLAG_CANCELED){
+	ev->ev_flags &= ~kEDP_EVENT_FLAG_CANCELED;
+	atomic_dec(&ee->ee_pendings);
+	edp_event_done(ev, -ECANCELED);
 	return ;
     }
 
-    if(ee->ee_handler[ev->ev_type] == emit_default_handler){
+    if(emit_class_lookup(ee->ee_class, ev->ev_type) == NULL){
 	log_warn("no handler for this event:%d!\n", ev->ev_type);
+	atomic_dec(&ee->ee_pendings);
 	edp_event_done(ev, -ENOENT);
 	return ;
     }
 
-    errcode = (ee->ee_handler[ev->ev_type])(ee, ev);
+    if(ee->ee_fiber){
+	errcode = fiber_run(emit_fiber_call, ev, ev->ev_priority);
+	if(errcode == 0)
+	    return ;
 
-//    spi_spin_lock(&eu->ee_lock);
-//    list_del(&ev->ev_edpu);
-//    spi_spin_unlock(&eu->ee_lock);
-    atomic_dec(&ee->ee_pendings);
+	log_warn("run fiber fail:%d!\n", errcode);
+	atomic_dec(&ee->ee_pendings);
+	edp_event_done(ev, errcode);
+	return ;
+    }
 
+    emit_event_call(ee, ev);
+}
+
+// a prepared event that will never run
+static void emit_event_fail(struct edp_emit *ee, edp_event_t *ev, int errcode){
+    emit_coalesce_clear(ee, ev);
+    atomic_dec(&ee->ee_pendings);
     edp_event_done(ev, errcode);
 }
 
-int emit_dispatch(emit_t em, edp_event_t *ev, edp_event_cb cb, void *data){
+// queue management sheds it, its handler never runs
+static void emit_event_shed(void *emit, struct edp_event *ev){
+    struct edp_emit *ee = (struct edp_emit *)emit;
+
+    ASSERT((emit != NULL) && emit_check(ee));
+
+    emit_event_fail(ee, ev, -kEDP_ERR_OVERLOAD);
+}
+
+// run strand events in order, stay on this worker while more come in
+static void emit_strand_run(void *emit, struct edp_event *runner){
+    struct edp_emit *ee = (struct edp_emit *)emit;
+    emit_strand_t   *st;
+    mpscq_node_t    *node, *next;
+    edp_event_t	    *ev;
+    int		    num;
+
+    ASSERT((emit != NULL) && emit_check(ee));
+    st = ee->ee_strand;
+
+    for(num = 0; num < EMIT_STRAND_BUDGET; num++){
+	if(list_empty(&st->st_runq)){
+	    node = mpscq_grab(&st->st_mailbox);
+	    while(node != NULL){
+		next = node->next;  // ev_node shares memory with ev_qnode
+		ev = container_of(node, edp_event_t, ev_qnode);
+		list_add_tail(&ev->ev_node, &st->st_runq);
+		node = next;
+	    }
+
+	    if(list_empty(&st->st_runq))
+		break;
+	}
+
+	ev = list_first_entry(&st->st_runq, edp_event_t, ev_node);
+	list_del(&ev->ev_node);
+
+	// waited too long in the mailbox
+	if(__edp_shed(ev, runner->ev_priority)){
+	    emit_event_shed(ee, ev);
+	    continue;
+	}
+
+	emit_event_handler(ee, ev);
+    }
+
+    if(atomic_sub(&st->st_queued, num) > 0){
+	// let other events of this worker go first
+	__edp_dispatch(runner);
+	return ;
+    }
+
+    // strand is idle, the next event may start it on another worker
+    atomic_dec(&ee->ee_pendings);
+}
+
+// queue prepared events of one strand, the first of them starts a runner.
+// they are counted before they are pushed, so the runner never takes one
+// not counted yet and st_queued never drops below 0.
+static int emit_strand_post(struct edp_emit *ee, edp_event_t **evs, int num){
+    emit_strand_t   *st = ee->ee_strand;
+    edp_event_t	    *runner = &st->st_runner;
+    int		    i, prio, start;
+
+    start = (atomic_add(&st->st_queued, num) == num);
+
+    for(i = 0; i < num; i++){
+	__edp_stamp(evs[i]);
+	mpscq_push(&st->st_mailbox, &evs[i]->ev_qnode);
+    }
+
+    if(!start)
+	return 0;
+
+    prio = runner->ev_priority;
+    atomic_inc(&ee->ee_pendings);
+
+    edp_event_init(runner, 0, prio);
+    runner->ev_flags = kEDP_EVENT_FLAG_ORDERED;
+    runner->ev_cpuid = __edp_select();
+    runner->ev_handler = emit_strand_run;
+    runner->ev_emit = ee;
+
+    return __edp_dispatch(runner);
+}
+
+// rejected like events for the queue the runner was dispatched to last
+static inline int emit_strand_admit(struct edp_emit *ee, edp_event_t *ev){
+    edp_event_t	    *runner = &ee->ee_strand->st_runner;
+
+    return __edp_admit(ev, runner->ev_cpuid, runner->ev_priority);
+}
+
+// runs of admitted ones go in at once, the others complete as shed
+static int emit_strand_batch(struct edp_emit *ee, edp_event_t **evs, int num){
+    int		    i, start = 0, ret = 0, err;
+
+    for(i = 0; i < num; i++){
+	if(emit_strand_admit(ee, evs[i]) == 0)
+	    continue;
+
+	if(i > start){
+	    err = emit_strand_post(ee, &evs[start], i - start);
+	    if(err != 0)
+		ret = err;
+	}
+
+	emit_event_shed(ee, evs[i]);
+	start = i + 1;
+    }
+
+    if(num > start){
+	err = emit_strand_post(ee, &evs[start], num - start);
+	if(err != 0)
+	    ret = err;
+    }
+
+    return ret;
+}
+
+// a due timer of a strand emitter joins the strand
+static void emit_timer_post(void *emit, struct edp_event *ev){
+    struct edp_emit *ee = (struct edp_emit *)emit;
+
+    ASSERT((emit != NULL) && emit_check(ee));
+
+    ev->ev_handler = emit_event_handler;
+    if(ev->ev_flags & kEDP_EVENT_FLAG_CANCELED){
+	emit_event_handler(ee, ev);
+	return ;
+    }
+
+    emit_strand_post(ee, &ev, 1);
+}
+
+static int emit_timer_arm(struct edp_emit *ee, emit_timer_t *mt,
+	edp_event_cb cb, void *data, uint32_t ms){
+    edp_event_t	    *ev = &mt->mt_timer.et_event;
+    int		    ret;
+
+    ret = emit_prepare(ee, ev, cb, data);
+    if(ret != 0){
+	return ret;
+    }
+
+    if(ee->ee_strand != NULL)
+	ev->ev_handler = emit_timer_post;
+
+    // due timers are never shed
+    ev->ev_flags |= kEDP_EVENT_FLAG_KEEP;
+
+    ret = edp_timer_add(&mt->mt_timer, ms);
+    if(ret != 0){
+	emit_coalesce_clear(ee, ev);
+	atomic_dec(&ee->ee_pendings);
+    }
+
+    return ret;
+}
+
+// completion of a periodic timer's run, arm it for the next one
+static void emit_timer_repeat(edp_event_t *ev, void *data, int errcode){
+    emit_timer_t    *mt = (emit_timer_t *)data;
+    edp_timer_t	    *tm = &mt->mt_timer;
+    uint64_t	    now, next;
+    uint32_t	    ms = 0;
+    int		    ret;
+
+    // stopped while armed
+    if(errcode == -ECANCELED){
+	mt->mt_cb(ev, mt->mt_data, errcode);
+	return ;
+    }
+
+    mt->mt_cb(ev, mt->mt_data, errcode);
+
+    // stopped while running, maybe by mt_cb
+    if(__atomic_load_n(&mt->mt_period, __ATOMIC_SEQ_CST) == 0){
+	mt->mt_cb(ev, mt->mt_data, -ECANCELED);
+	return ;
+    }
+
+    // keep the rate, runs missed meanwhile are skipped
+    now = spi_time_now() / 1000000;
+    next = tm->et_expire + mt->mt_period;
+    if(next > now)
+	ms = (uint32_t)(next - now);
+
+    if(!(ev->ev_flags & kEDP_EVENT_FLAG_ORDERED))
+	ev->ev_cpuid = -1;
+
+    // can't go on, tell why: -EALREADY of a coalescing type for instance
+    ret = emit_timer_arm(ev->ev_emit, mt, emit_timer_repeat, mt, ms);
+    if(ret != 0){
+	mt->mt_period = 0;
+	mt->mt_cb(ev, mt->mt_data, ret);
+	return ;
+    }
+
+    // emit_timer_cancel saw it between runs, one of us cancels it
+    if(__atomic_load_n(&mt->mt_period, __ATOMIC_SEQ_CST) == 0)
+	edp_timer_cancel(tm);
+}
+
+int emit_dispatch_after(emit_t em, emit_timer_t *mt, edp_event_cb cb, void *data, uint32_t ms){
+    ASSERT((em != NULL) && (mt != NULL));
+
+    mt->mt_period = 0;
+    mt->mt_cb = cb;
+    mt->mt_data = data;
+
+    return emit_timer_arm(em, mt, cb, data, ms);
+}
+
+int emit_dispatch_every(emit_t em, emit_timer_t *mt, edp_event_cb cb, void *data, uint32_t ms){
+    int	    ret;
+
+    ASSERT((em != NULL) && (mt != NULL));
+
+    if(ms == 0){
+	return -EINVAL;
+    }
+
+    mt->mt_cb = cb;
+    mt->mt_data = data;
+    __atomic_store_n(&mt->mt_period, ms, __ATOMIC_SEQ_CST);
+
+    ret = emit_timer_arm(em, mt, emit_timer_repeat, mt, ms);
+    if(ret != 0){
+	mt->mt_period = 0;
+    }
+
+    return ret;
+}
+
+int emit_timer_cancel(emit_timer_t *mt){
+    uint32_t	    period;
+    int		    ret;
+
+    ASSERT(mt != NULL);
+
+    period = __atomic_exchange_n(&mt->mt_period, 0, __ATOMIC_SEQ_CST);
+
+    ret = edp_timer_cancel(&mt->mt_timer);
+
+    // a periodic one running now ends with -ECANCELED after its run
+    return (period != 0) ? 0 : ret;
+}
+
+int emit_prepare(emit_t em, edp_event_t *ev, edp_event_cb cb, void *data){
     struct edp_emit  *ee = em;
+    uint64_t	    bit, home, moved;
 
     ASSERT(ee != NULL);
     ASSERT(ev != NULL);
 
-    if((ev->ev_type < 0) || (ev->ev_type >= kEMIT_EVENT_TYPE_MAX)){
+    if((ev->ev_priority < kEDP_EVENT_PRIORITY_IDLE) ||
+	    (ev->ev_priority >= kEDP_EVENT_PRIORITY_MAX)){
+	log_warn("event priority overflow:%d!\n", ev->ev_priority);
+	return -ERANGE;
+    }
+
+    if((ev->ev_type < 0) || (ev->ev_type >= emit_class_types(ee->ee_class))){
 	log_warn("event type overflow:%d!\n", ev->ev_type);
 	return -ERANGE;
     }
 
-    if(ee->ee_handler[ev->ev_type] == emit_default_handler){
+    if(emit_class_lookup(ee->ee_class, ev->ev_type) == NULL){
 	log_warn("no handler for this event:%d!\n", ev->ev_type);
 	return -ENOENT;
     }
@@ -105,51 +505,412 @@ int emit_dispatch(emit_t em, edp_event_t *ev, edp_event_cb cb, void *data){
 	return -EINVAL;
     }
 
+    bit = emit_coalesce_bit(ee, ev->ev_type);
+    if((bit != 0) && (__atomic_fetch_or(&ee->ee_coalesced, bit, __ATOMIC_SEQ_CST) & bit)){
+	return -EALREADY;
+    }
+
     ev->ev_cb	= cb;
     ev->ev_data	= data;
 
     ev->ev_handler = emit_event_handler;
     ev->ev_emit	= ee;
 
+    // ordered events of one emitter all go to its home worker. a retired
+    // home gets them until it handed its events over, then the worker it
+    // handed them to is the new home
+    if(ev->ev_flags & kEDP_EVENT_FLAG_ORDERED){
+	home = ee->ee_home;
+	moved = __edp_home(home, ee->ee_pendings == 0);
+	if(moved != home)
+	    __sync_bool_compare_and_swap(&ee->ee_home, home, moved);
+	ev->ev_cpuid = kEDP_HOME_CPUID(ee->ee_home);
+    }
+
 //    spi_spin_lock(&eu->ee_lock);
 //    list_add(&ev->ev_edpu, &eu->ee_events);
 //    spi_spin_unlock(&eu->ee_lock);
     atomic_inc(&ee->ee_pendings);
 
-    return __edp_dispatch(ev);
+    return 0;
 }
 
-int emit_add_handler(emit_t em, int type, emit_handler handler){
+int emit_submit(edp_event_t *ev){
+    struct edp_emit *ee;
+    int		    ret;
+
+    ASSERT(ev != NULL);
+
+    ee = ev->ev_emit;
+    if(ee->ee_strand != NULL){
+	ret = emit_strand_admit(ee, ev);
+	if(ret == 0)
+	    return emit_strand_post(ee, &ev, 1);
+    }else{
+	ret = __edp_dispatch(ev);
+    }
+
+    // not queued, the caller still owns it
+    if(ret != 0){
+	emit_coalesce_clear(ee, ev);
+	atomic_dec(&ee->ee_pendings);
+    }
+
+    return ret;
+}
+
+int emit_dispatch(emit_t em, edp_event_t *ev, edp_event_cb cb, void *data){
+    int	    ret;
+
+    ret = emit_prepare(em, ev, cb, data);
+    if(ret != 0){
+	return ret;
+    }
+
+    return emit_submit(ev);
+}
+
+// a run workers refused as a whole, it can't go back to the caller either
+static int emit_batch_fail(edp_event_t **evs, int num, int errcode){
+    int		    i;
+
+    for(i = 0; i < num; i++){
+	emit_event_fail(evs[i]->ev_emit, evs[i], errcode);
+    }
+
+    return errcode;
+}
+
+int emit_dispatch_batch(edp_event_t **evs, int num){
+    struct edp_emit *ee;
+    int		    i, j, start = 0, ret = 0, err;
+
+    // runs of strand events go to their mailbox, the rest to workers
+    for(i = 0; i < num; i = j){
+	ee = evs[i]->ev_emit;
+	if(ee->ee_strand == NULL){
+	    j = i + 1;
+	    continue;
+	}
+
+	if(i > start){
+	    err = __edp_dispatch_batch(&evs[start], i - start);
+	    if(err != 0)
+		ret = emit_batch_fail(&evs[start], i - start, err);
+	}
+
+	for(j = i + 1; (j < num) && (evs[j]->ev_emit == ee); j++);
+
+	err = emit_strand_batch(ee, &evs[i], j - i);
+	if(err != 0)
+	    ret = err;
+
+	start = j;
+    }
+
+    if(num > start){
+	err = __edp_dispatch_batch(&evs[start], num - start);
+	if(err != 0)
+	    ret = emit_batch_fail(&evs[start], num - start, err);
+    }
+
+    return ret;
+}
+
+static void emit_publish_put(emit_pub_t *ep){
+    edp_event_t	    *ev = ep->ep_event;
+    int		    errcode;
+
+    if(atomic_dec(&ep->ep_refs) != 0)
+	return ;
+
+    errcode = ep->ep_errcode;
+    mheap_free(ep);
+
+    edp_event_done(ev, errcode);
+}
+
+static void emit_publish_done(edp_event_t *ev, void *data, int errcode){
+    emit_pub_t	    *ep = (emit_pub_t *)data;
+
+    if(errcode != 0)
+	__sync_bool_compare_and_swap(&ep->ep_errcode, 0, errcode);
+
+    emit_publish_put(ep);
+}
+
+int emit_publish(emit_t *ems, int num, edp_event_t *ev, edp_event_cb cb, void *data){
+    emit_pub_t	    *ep;
+    edp_event_t	    *node;
+    int		    i, ready = 0, ret;
+
+    ASSERT((ems != NULL) && (ev != NULL));
+
+    if(num <= 0){
+	return -EINVAL;
+    }
+
+    ep = (emit_pub_t *)mheap_alloc(sizeof(*ep) +
+	    (sizeof(edp_event_t) + sizeof(edp_event_t *)) * num);
+    if(ep == NULL){
+	log_warn("not enough memory!\n");
+	return -ENOMEM;
+    }
+
+    ev->ev_cb = cb;
+    ev->ev_data = data;
+
+    ep->ep_event = ev;
+    ep->ep_errcode = 0;
+    ep->ep_evs = (edp_event_t **)&ep->ep_nodes[num];
+    // nodes, and ours until all of them are out
+    atomic_reset(&ep->ep_refs);
+    atomic_add(&ep->ep_refs, num + 1);
+
+    for(i = 0; i < num; i++){
+	node = &ep->ep_nodes[i];
+	edp_event_init(node, ev->ev_type, ev->ev_priority);
+	node->ev_flags = ev->ev_flags & kEDP_EVENT_FLAG_ORDERED;
+	node->ev_deadline = ev->ev_deadline;
+
+	ret = emit_prepare(ems[i], node, emit_publish_done, ep);
+	if(ret != 0){
+	    // coalesced into one pending there, the subscriber gets it anyway
+	    if(ret != -EALREADY)
+		__sync_bool_compare_and_swap(&ep->ep_errcode, 0, ret);
+	    atomic_dec(&ep->ep_refs);
+	    continue;
+	}
+
+	ep->ep_evs[ready++] = node;
+    }
+
+    // nodes it can't queue complete by emit_publish_done with the error
+    if(ready > 0){
+	ret = emit_dispatch_batch(ep->ep_evs, ready);
+	if(ret != 0)
+	    log_warn("publish to %d emitters partly failed:%d!\n", ready, ret);
+    }
+
+    emit_publish_put(ep);
+
+    return 0;
+}
+
+edp_event_t *emit_published(edp_event_t *ev){
+    ASSERT(ev != NULL);
+
+    if(ev->ev_cb != emit_publish_done)
+	return NULL;
+
+    return ((emit_pub_t *)ev->ev_data)->ep_event;
+}
+
+void emit_publish_hold(edp_event_t *ev){
+    ASSERT((ev != NULL) && (ev->ev_cb == emit_publish_done));
+
+    atomic_inc(&((emit_pub_t *)ev->ev_data)->ep_refs);
+}
+
+void emit_publish_release(edp_event_t *ev){
+    ASSERT((ev != NULL) && (ev->ev_cb == emit_publish_done));
+
+    emit_publish_put((emit_pub_t *)ev->ev_data);
+}
+
+int emit_strand(emit_t em, int priority){
     struct edp_emit *ee = em;
+    emit_strand_t   *st;
 
     ASSERT(ee != NULL);
 
-    if((type < 0) || (type >= kEMIT_EVENT_TYPE_MAX)){
-	log_warn("event type overflow:%d!\n", type);
+    if((priority < kEDP_EVENT_PRIORITY_IDLE) ||
+	    (priority >= kEDP_EVENT_PRIORITY_MAX)){
+	log_warn("strand priority overflow:%d!\n", priority);
 	return -ERANGE;
     }
 
-    ee->ee_handler[type] = handler;
+    if(ee->ee_pendings != 0){
+	log_warn("emit still have pending events!\n");
+	return -EBUSY;
+    }
+
+    if(ee->ee_fiber){
+	log_warn("emit runs on fibers!\n");
+	return -EINVAL;
+    }
+
+    st = ee->ee_strand;
+    if(st == NULL){
+	st = (emit_strand_t *)mheap_alloc(sizeof(*st));
+	if(st == NULL){
+	    log_warn("not enough memory!\n");
+	    return -ENOMEM;
+	}
+
+	mpscq_init(&st->st_mailbox);
+	atomic_reset(&st->st_queued);
+	INIT_LIST_HEAD(&st->st_runq);
+	st->st_runner.ev_cpuid = -1;
+    }
+
+    st->st_runner.ev_priority = (short)priority;
+    ee->ee_strand = st;
+
     return 0;
 }
 
-int emit_rmv_watch(emit_t em, int type){
+int emit_fiber(emit_t em){
     struct edp_emit *ee = em;
 
     ASSERT(ee != NULL);
 
-    if((type < 0) || (type >= kEMIT_EVENT_TYPE_MAX)){
-	log_warn("event type overflow:%d!\n", type);
+    if(ee->ee_pendings != 0){
+	log_warn("emit still have pending events!\n");
+	return -EBUSY;
+    }
+
+    if(ee->ee_strand != NULL){
+	log_warn("emit is a strand!\n");
+	return -EINVAL;
+    }
+
+    ee->ee_fiber = 1;
+
+    return 0;
+}
+
+int emit_class_create(int types, emit_class_t *ec){
+    struct emit_class	*c;
+    size_t		size;
+
+    ASSERT(ec != NULL);
+
+    if((types <= 0) || (types > kEMIT_CLASS_TYPE_MAX)){
+	log_warn("class types overflow:%d!\n", types);
+	return -ERANGE;
+    }
+
+    size = sizeof(*c) + sizeof(emit_handler *) *
+	((types + EMIT_CLASS_PAGE_MASK) >> EMIT_CLASS_PAGE_SHIFT);
+    c = (struct emit_class *)mheap_alloc(size);
+    if(c == NULL){
+	log_warn("not enough memory!\n");
+	return -ENOMEM;
+    }
+    memset(c, 0, size);
+
+    c->ec_types = types;
+    *ec = c;
+
+    return 0;
+}
+
+int emit_class_destroy(emit_class_t ec){
+    ASSERT((ec != NULL) && !ec->ec_private);
+
+    emit_class_free(ec);
+    return 0;
+}
+
+int emit_class_add_handler(emit_class_t ec, int type, emit_handler handler){
+    ASSERT(ec != NULL);
+
+    if(ec->ec_sealed){
+	log_warn("class has emitters already!\n");
+	return -EBUSY;
+    }
+
+    return emit_class_set(ec, type, handler);
+}
+
+// the private class of an emit_create emitter, made on first use
+static int emit_own_class(struct edp_emit *ee){
+    int		    ret;
+
+    if(ee->ee_class != NULL){
+	if(ee->ee_class->ec_private)
+	    return 0;
+
+	log_warn("emit handlers are its class's!\n");
+	return -EPERM;
+    }
+
+    ret = emit_class_create(kEMIT_EVENT_TYPE_MAX, &ee->ee_class);
+    if(ret != 0)
+	return ret;
+
+    ee->ee_class->ec_private = 1;
+    return 0;
+}
+
+int emit_class_coalesce(emit_class_t ec, int type){
+    ASSERT(ec != NULL);
+
+    if(ec->ec_sealed){
+	log_warn("class has emitters already!\n");
+	return -EBUSY;
+    }
+
+    if((type < 0) || (type >= kEMIT_COALESCE_TYPE_MAX) || (type >= ec->ec_types)){
+	log_warn("coalesce type overflow:%d!\n", type);
 	return -ERANGE;
     }
 
-    ee->ee_handler[type] = emit_default_handler;
+    ec->ec_coalesce |= 1ULL << type;
     return 0;
 }
 
+int emit_coalesce(emit_t em, int type){
+    struct edp_emit *ee = em;
+    int		    ret;
+
+    ASSERT(ee != NULL);
+
+    ret = emit_own_class(ee);
+    if(ret != 0)
+	return ret;
+
+    return emit_class_coalesce(ee->ee_class, type);
+}
+
+int emit_add_handler(emit_t em, int type, emit_handler handler){
+    struct edp_emit *ee = em;
+    int		    ret;
+
+    ASSERT(ee != NULL);
+
+    ret = emit_own_class(ee);
+    if(ret != 0)
+	return ret;
+
+    return emit_class_set(ee->ee_class, type, handler);
+}
+
+int emit_rmv_handler(emit_t em, int type){
+    struct edp_emit *ee = em;
+
+    ASSERT(ee != NULL);
+
+    if((ee->ee_class != NULL) && !ee->ee_class->ec_private){
+	log_warn("emit handlers are its class's!\n");
+	return -EPERM;
+    }
+
+    if(ee->ee_class == NULL){
+	return ((type >= 0) && (type < kEMIT_EVENT_TYPE_MAX)) ? 0 : -ERANGE;
+    }
+
+    return emit_class_set(ee->ee_class, type, NULL);
+}
+
 int emit_create(void *data, emit_t *em){
+    return emit_create_class(NULL, data, em);
+}
+
+int emit_create_class(emit_class_t ec, void *data, emit_t *em){
     struct edp_emit  *ee;
-    int	    i;
+    emit_shard_t    *es;
 
     ASSERT(em != NULL);
 
@@ -161,21 +922,29 @@ int emit_create(void *data, emit_t *em){
     memset(ee, 0, sizeof(*ee));
 
     ee->ee_magic = EMIT_INSTANCE_MAGIC;
+    ee->ee_home = kEDP_HOME_NONE;
     spi_spin_init(&ee->ee_lock);
     atomic_reset(&ee->ee_pendings);
 //    INIT_LIST_HEAD(&ee->ee_events);
     INIT_LIST_HEAD(&ee->ee_node);
 
-    for(i = 0; i < kEMIT_EVENT_TYPE_MAX; i++){
-	ee->ee_handler[i] = emit_default_handler;
+    if(ec != NULL){
+	ASSERT(!ec->ec_private);
+	ec->ec_sealed = 1;
+	ee->ee_class = ec;
     }
 
     ee->ee_data	= data;
     ee->ee_init	= 1;
 
-    spi_spin_lock(&__emit_data.ed_lock);
-    list_add(&ee->ee_node, &__emit_data.ed_emits);
-    spi_spin_unlock(&__emit_data.ed_lock);
+    if(__emit_shard < 0)
+	__emit_shard = (int)(atomic_inc(&__emit_data.ed_threads) % EMIT_SHARDS);
+    ee->ee_shard = __emit_shard;
+
+    es = &__emit_data.ed_shards[ee->ee_shard];
+    spi_spin_lock(&es->es_lock);
+    list_add(&ee->ee_node, &es->es_emits);
+    spi_spin_unlock(&es->es_lock);
 
     *em = ee;
 
@@ -184,6 +953,7 @@ int emit_create(void *data, emit_t *em){
 
 int emit_destroy(emit_t em){
     struct edp_emit *ee = em;
+    emit_shard_t    *es;
 
     ASSERT(ee != NULL);
 
@@ -194,12 +964,19 @@ int emit_destroy(emit_t em){
 
     ee->ee_init = 0;
 
-    spi_spin_lock(&__emit_data.ed_lock);
+    es = &__emit_data.ed_shards[ee->ee_shard];
+    spi_spin_lock(&es->es_lock);
     list_del(&ee->ee_node);
-    spi_spin_unlock(&__emit_data.ed_lock);
+    spi_spin_unlock(&es->es_lock);
 
     spi_spin_fini(&ee->ee_lock);
 
+    if((ee->ee_class != NULL) && ee->ee_class->ec_private)
+	emit_class_free(ee->ee_class);
+
+    if(ee->ee_strand != NULL)
+	mheap_free(ee->ee_strand);
+
     mheap_free(ee);
 
     return 0;
@@ -227,36 +1004,69 @@ void *emit_set(emit_t em, void *data){
     return old;
 }
 
+int emit_foreach(emit_visit visit, void *arg){
+    emit_data_t	    *ed = &__emit_data;
+    emit_shard_t    *es;
+    struct edp_emit *ee;
+    int		    i, ret = 0;
+
+    ASSERT(visit != NULL);
+
+    for(i = 0; (i < EMIT_SHARDS) && (ret == 0); i++){
+	es = &ed->ed_shards[i];
+
+	spi_spin_lock(&es->es_lock);
+	list_for_each_entry(ee, &es->es_emits, ee_node){
+	    ret = visit(ee, arg);
+	    if(ret != 0)
+		break;
+	}
+	spi_spin_unlock(&es->es_lock);
+    }
+
+    return ret;
+}
+
 int emit_init(){
     emit_data_t	*ed = &__emit_data;
+    int		i;
 
     if(ed->ed_init){
 	return 0;
     }
 
     ed->ed_init = 1;
-    spi_spin_init(&ed->ed_lock);
-    INIT_LIST_HEAD(&ed->ed_emits);
+    atomic_reset(&ed->ed_threads);
+
+    // workers shed emitter events through us, the counts stay right
+    __edp_shed_hook(emit_event_handler, emit_event_shed);
+
+    for(i = 0; i < EMIT_SHARDS; i++){
+	spi_spin_init(&ed->ed_shards[i].es_lock);
+	INIT_LIST_HEAD(&ed->ed_shards[i].es_emits);
+    }
 
     return 0;
 }
 
 int emit_fini(){
     emit_data_t	*ed = &__emit_data;
+    int		i;
 
     if(ed->ed_init == 0){
 	return 0;
     }
 
-    spi_spin_lock(&ed->ed_lock);
-    if(!list_empty(&ed->ed_emits)){
-	spi_spin_unlock(&ed->ed_lock);
-	return -EINVAL;
+    for(i = 0; i < EMIT_SHARDS; i++){
+	if(!list_empty(&ed->ed_shards[i].es_emits))
+	    return -EINVAL;
     }
     ed->ed_init = 0;
-    spi_spin_unlock(&ed->ed_lock);
-    
-    spi_spin_fini(&ed->ed_lock);
+
+    for(i = 0; i < EMIT_SHARDS; i++){
+	spi_spin_fini(&ed->ed_shards[i].es_lock);
+    }
+
     return 0;
 }
 
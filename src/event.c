@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2013, Konghan. All rights reserved.
+ * Distributed under the BSD license, see the LICENSE file.
+ */
+
+#include "edp.h"
+
+#include "atomic.h"
+#include "logger.h"
+#include "mcache.h"
+
+#define EVENT_CLASS_SHIFT	7   // smallest block 128 bytes
+#define EVENT_CLASSES		6   // up to 4KB blocks
+#define EVENT_HEAP		EVENT_CLASSES	// class of heap blocks
+#define EVENT_BATCH		32  // blocks a thread trades at once
+#define EVENT_CACHE_MAX		(EVENT_BATCH * 2)   // blocks a thread keeps per class
+#define EVENT_SHARED_MAX	256 // batches the shared pool keeps per class
+
+// before the event, payload right after it
+typedef struct event_head{
+    uint32_t		eh_class;
+    uint32_t		eh_size;    // payload size asked for
+    uint64_t		eh_pad;	    // keeps the event 16 bytes aligned
+}event_head_t;
+
+// a free block, the first of a batch links the next batch
+typedef struct event_free{
+    struct event_free	*ef_next;
+    struct event_free	*ef_batch;
+}event_free_t;
+
+typedef struct event_pool{
+    spi_spinlock_t	ep_lock;
+    event_free_t	*ep_batches;	// full batches only
+    int			ep_num;
+}__spi_cacheline event_pool_t;
+
+typedef struct event_cache{
+    event_free_t	*ec_free[EVENT_CLASSES];
+    int			ec_num[EVENT_CLASSES];
+}event_cache_t;
+
+typedef struct event_data{
+    int			ed_init;
+    event_pool_t	ed_pools[EVENT_CLASSES];
+}event_data_t;
+
+static event_data_t		__event_data = {};
+static __thread event_cache_t	__event_cache = {};
+
+static inline size_t event_block_size(int cls){
+    return (size_t)1 << (cls + EVENT_CLASS_SHIFT);
+}
+
+static int event_class(size_t size){
+    size_t	    total = sizeof(event_head_t) + sizeof(edp_event_t) + size;
+    int		    cls;
+
+    for(cls = 0; cls < EVENT_CLASSES; cls++){
+	if(total <= event_block_size(cls))
+	    return cls;
+    }
+
+    return EVENT_HEAP;
+}
+
+// take a batch from the shared pool, or make one
+static int event_refill(event_cache_t *ec, int cls){
+    event_pool_t    *ep = &__event_data.ed_pools[cls];
+    event_free_t    *ef = NULL;
+    int		    i;
+
+    if(__event_data.ed_init){
+	spi_spin_lock(&ep->ep_lock);
+	ef = ep->ep_batches;
+	if(ef != NULL){
+	    ep->ep_batches = ef->ef_batch;
+	    ep->ep_num--;
+	}
+	spi_spin_unlock(&ep->ep_lock);
+    }
+
+    if(ef != NULL){
+	ec->ec_free[cls] = ef;
+	ec->ec_num[cls] = EVENT_BATCH;
+	return 0;
+    }
+
+    for(i = 0; i < EVENT_BATCH; i++){
+	ef = (event_free_t *)mheap_alloc(event_block_size(cls));
+	if(ef == NULL)
+	    break;
+
+	ef->ef_next = ec->ec_free[cls];
+	ec->ec_free[cls] = ef;
+	ec->ec_num[cls]++;
+    }
+
+    return (ec->ec_num[cls] > 0) ? 0 : -ENOMEM;
+}
+
+// hand a batch of this thread's blocks to the shared pool
+static void event_spill(event_cache_t *ec, int cls){
+    event_pool_t    *ep = &__event_data.ed_pools[cls];
+    event_free_t    *first, *last, *ef;
+    int		    i;
+
+    first = last = ec->ec_free[cls];
+    for(i = 1; i < EVENT_BATCH; i++){
+	last = last->ef_next;
+    }
+    ec->ec_free[cls] = last->ef_next;
+    ec->ec_num[cls] -= EVENT_BATCH;
+    last->ef_next = NULL;
+
+    if(__event_data.ed_init){
+	spi_spin_lock(&ep->ep_lock);
+	if(ep->ep_num < EVENT_SHARED_MAX){
+	    first->ef_batch = ep->ep_batches;
+	    ep->ep_batches = first;
+	    ep->ep_num++;
+	    first = NULL;
+	}
+	spi_spin_unlock(&ep->ep_lock);
+    }
+
+    while((ef = first) != NULL){
+	first = ef->ef_next;
+	mheap_free(ef);
+    }
+}
+
+edp_event_t *edp_event_alloc(short type, short priority, size_t size){
+    event_cache_t   *ec = &__event_cache;
+    event_head_t    *eh;
+    event_free_t    *ef;
+    edp_event_t	    *ev;
+    int		    cls;
+
+    cls = event_class(size);
+    if(cls == EVENT_HEAP){
+	eh = (event_head_t *)mheap_alloc(sizeof(*eh) + sizeof(*ev) + size);
+    }else{
+	if((ec->ec_free[cls] == NULL) && (event_refill(ec, cls) != 0)){
+	    log_warn("not enough memory!\n");
+	    return NULL;
+	}
+
+	ef = ec->ec_free[cls];
+	ec->ec_free[cls] = ef->ef_next;
+	ec->ec_num[cls]--;
+	eh = (event_head_t *)ef;
+    }
+
+    if(eh == NULL){
+	log_warn("not enough memory!\n");
+	return NULL;
+    }
+
+    eh->eh_class = cls;
+    eh->eh_size = (uint32_t)size;
+
+    ev = (edp_event_t *)(eh + 1);
+    edp_event_init(ev, type, priority);
+
+    return ev;
+}
+
+void edp_event_free(edp_event_t *ev){
+    event_cache_t   *ec = &__event_cache;
+    event_head_t    *eh;
+    event_free_t    *ef;
+    int		    cls;
+
+    if(ev == NULL)
+	return ;
+
+    eh = (event_head_t *)ev - 1;
+    cls = eh->eh_class;
+    if(cls == EVENT_HEAP){
+	mheap_free(eh);
+	return ;
+    }
+
+    ef = (event_free_t *)eh;
+    ef->ef_next = ec->ec_free[cls];
+    ec->ec_free[cls] = ef;
+    if(++ec->ec_num[cls] > EVENT_CACHE_MAX)
+	event_spill(ec, cls);
+}
+
+size_t edp_event_size(edp_event_t *ev){
+    ASSERT(ev != NULL);
+
+    return ((event_head_t *)ev - 1)->eh_size;
+}
+
+void edp_event_drain(void){
+    event_cache_t   *ec = &__event_cache;
+    event_free_t    *ef;
+    int		    cls;
+
+    for(cls = 0; cls < EVENT_CLASSES; cls++){
+	while(ec->ec_num[cls] >= EVENT_BATCH){
+	    event_spill(ec, cls);
+	}
+
+	while((ef = ec->ec_free[cls]) != NULL){
+	    ec->ec_free[cls] = ef->ef_next;
+	    mheap_free(ef);
+	}
+	ec->ec_num[cls] = 0;
+    }
+}
+
+int __edp_event_init(void){
+    event_data_t    *ed = &__event_data;
+    int		    cls;
+
+    if(ed->ed_init)
+	return 0;
+
+    for(cls = 0; cls < EVENT_CLASSES; cls++){
+	spi_spin_init(&ed->ed_pools[cls].ep_lock);
+	ed->ed_pools[cls].ep_batches = NULL;
+	ed->ed_pools[cls].ep_num = 0;
+    }
+    ed->ed_init = 1;
+
+    return 0;
+}
+
+int __edp_event_fini(void){
+    event_data_t    *ed = &__event_data;
+    event_free_t    *batch, *ef;
+    int		    cls;
+
+    if(!ed->ed_init)
+	return 0;
+
+    // the caller's blocks go with the shared ones
+    edp_event_drain();
+    ed->ed_init = 0;
+
+    for(cls = 0; cls < EVENT_CLASSES; cls++){
+	while((batch = ed->ed_pools[cls].ep_batches) != NULL){
+	    ed->ed_pools[cls].ep_batches = batch->ef_batch;
+	    while((ef = batch) != NULL){
+		batch = ef->ef_next;
+		mheap_free(ef);
+	    }
+	}
+	ed->ed_pools[cls].ep_num = 0;
+	spi_spin_fini(&ed->ed_pools[cls].ep_lock);
+    }
+
+    return 0;
+}
@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2013, Konghan. All rights reserved.
+ * Distributed under the BSD license, see the LICENSE file.
+ */
+
+#include "fiber.h"
+#include "timer.h"
+
+#include "logger.h"
+#include "mcache.h"
+
+struct fiber{
+    __spi_context_t	fb_ctx;	    // saved while switched out
+    __spi_context_t	*fb_back;   // who switched to it
+    void		*fb_stack;
+    size_t		fb_size;
+
+    fiber_fn		fb_fn;
+    void		*fb_arg;
+    int			fb_done;
+    int			fb_result;  // given by fiber_resume
+    short		fb_priority;
+    short		fb_cpuid;   // worker it runs on
+    edp_event_t		fb_resume;  // switches back to it
+
+    struct fiber	*fb_next;   // idle pool
+};
+
+static __thread __spi_context_t	__fiber_main;	// the worker's own stack
+static __thread fiber_t		*__fiber_current = NULL;
+static __thread fiber_t		*__fiber_pool = NULL;
+static __thread int		__fiber_pooled = 0;
+
+static void fiber_entry(void *arg){
+    fiber_t	    *fb = (fiber_t *)arg;
+
+    fb->fb_fn(fb->fb_arg);
+
+    fb->fb_done = 1;
+    __spi_context_switch(&fb->fb_ctx, fb->fb_back);
+}
+
+static fiber_t *fiber_get(void){
+    fiber_t	    *fb;
+
+    fb = __fiber_pool;
+    if(fb != NULL){
+	__fiber_pool = fb->fb_next;
+	__fiber_pooled--;
+	return fb;
+    }
+
+    fb = mheap_alloc(sizeof(*fb));
+    if(fb == NULL)
+	return NULL;
+
+    fb->fb_size = kFIBER_STACK_SIZE;
+    fb->fb_stack = __spi_stack_alloc(&fb->fb_size);
+    if(fb->fb_stack == NULL){
+	mheap_free(fb);
+	return NULL;
+    }
+
+    return fb;
+}
+
+static void fiber_put(fiber_t *fb){
+    if(__fiber_pooled >= kFIBER_POOL_MAX){
+	__spi_stack_free(fb->fb_stack, fb->fb_size);
+	mheap_free(fb);
+	return ;
+    }
+
+    fb->fb_next = __fiber_pool;
+    __fiber_pool = fb;
+    __fiber_pooled++;
+}
+
+// switch to fb until it suspends or finishes, fibers may nest
+static void fiber_enter(fiber_t *fb){
+    fiber_t	    *prev = __fiber_current;
+
+    fb->fb_back = (prev != NULL) ? &prev->fb_ctx : &__fiber_main;
+    fb->fb_cpuid = (short)__edp_self();
+    __fiber_current = fb;
+
+    __spi_context_switch(fb->fb_back, &fb->fb_ctx);
+
+    __fiber_current = prev;
+    if(fb->fb_done)
+	fiber_put(fb);
+}
+
+static void fiber_resume_handler(void *edm, struct edp_event *ev){
+    fiber_enter((fiber_t *)edm);
+}
+
+int fiber_run(fiber_fn fn, void *arg, int priority){
+    fiber_t	    *fb;
+
+    ASSERT(fn != NULL);
+
+    if(__edp_self() < 0){
+	log_warn("fiber out of workers!\n");
+	return -EPERM;
+    }
+
+    if((priority < kEDP_EVENT_PRIORITY_IDLE) ||
+	    (priority >= kEDP_EVENT_PRIORITY_MAX)){
+	log_warn("fiber priority overflow:%d!\n", priority);
+	return -ERANGE;
+    }
+
+    fb = fiber_get();
+    if(fb == NULL){
+	log_warn("alloc fiber fail!\n");
+	return -ENOMEM;
+    }
+
+    fb->fb_fn = fn;
+    fb->fb_arg = arg;
+    fb->fb_done = 0;
+    fb->fb_result = 0;
+    fb->fb_priority = (short)priority;
+    __spi_context_make(&fb->fb_ctx, fb->fb_stack, fb->fb_size, fiber_entry, fb);
+
+    fiber_enter(fb);
+
+    return 0;
+}
+
+fiber_t *fiber_self(void){
+    return __fiber_current;
+}
+
+int fiber_suspend(void){
+    fiber_t	    *fb = __fiber_current;
+
+    if(fb == NULL){
+	log_warn("suspend out of fibers!\n");
+	return -EPERM;
+    }
+
+    __spi_context_switch(&fb->fb_ctx, fb->fb_back);
+
+    // may run on another thread from here, if the worker retired
+    return fb->fb_result;
+}
+
+static void fiber_resume_done(edp_event_t *ev, void *data, int errcode){
+}
+
+int fiber_resume(fiber_t *fb, int result){
+    edp_event_t	    *ev = &fb->fb_resume;
+
+    ASSERT(fb != NULL);
+
+    fb->fb_result = result;
+
+    edp_event_init(ev, 0, fb->fb_priority);
+    ev->ev_flags = kEDP_EVENT_FLAG_ORDERED;
+    ev->ev_cpuid = fb->fb_cpuid;
+    ev->ev_cb = fiber_resume_done;
+    ev->ev_data = NULL;
+    ev->ev_emit = fb;
+    ev->ev_handler = fiber_resume_handler;
+
+    return __edp_dispatch(ev);
+}
+
+// expired on the fiber's own worker, switch to it right away
+static void fiber_sleep_handler(void *edm, struct edp_event *ev){
+    fiber_t	    *fb = (fiber_t *)edm;
+
+    fb->fb_result = 0;
+    fiber_enter(fb);
+}
+
+int fiber_sleep(uint32_t ms){
+    fiber_t	    *fb = __fiber_current;
+    edp_timer_t	    tm;
+    int		    ret;
+
+    if(fb == NULL){
+	log_warn("sleep out of fibers!\n");
+	return -EPERM;
+    }
+
+    edp_timer_init(&tm);
+    edp_event_init(&tm.et_event, 0, fb->fb_priority);
+    tm.et_event.ev_flags = kEDP_EVENT_FLAG_ORDERED;
+    tm.et_event.ev_cpuid = fb->fb_cpuid;
+    tm.et_event.ev_cb = fiber_resume_done;
+    tm.et_event.ev_data = NULL;
+    tm.et_event.ev_emit = fb;
+    tm.et_event.ev_handler = fiber_sleep_handler;
+
+    ret = edp_timer_add(&tm, ms);
+    if(ret != 0)
+	return ret;
+
+    return fiber_suspend();
+}
+
+void __fiber_drain(void){
+    fiber_t	    *fb;
+
+    while((fb = __fiber_pool) != NULL){
+	__fiber_pool = fb->fb_next;
+	__spi_stack_free(fb->fb_stack, fb->fb_size);
+	mheap_free(fb);
+    }
+
+    __fiber_pooled = 0;
+}
+
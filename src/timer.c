@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2013, Konghan. All rights reserved.
+ * Distributed under the BSD license, see the LICENSE file.
+ */
+
+#include "timer.h"
+
+#include "logger.h"
+
+// ticks one slot of a level spans
+static inline int timer_level_shift(int level){
+    return kTIMER_ROOT_BITS + level * kTIMER_LEVEL_BITS;
+}
+
+void timer_wheel_init(timer_wheel_t *tw, uint64_t now){
+    int	    i, j;
+
+    tw->tw_now = now;
+    tw->tw_count = 0;
+
+    for(i = 0; i < kTIMER_ROOT_SIZE; i++){
+	INIT_LIST_HEAD(&tw->tw_root[i]);
+    }
+
+    for(i = 0; i < kTIMER_LEVELS; i++){
+	for(j = 0; j < kTIMER_LEVEL_SIZE; j++){
+	    INIT_LIST_HEAD(&tw->tw_levels[i][j]);
+	}
+    }
+}
+
+static void timer_wheel_link(timer_wheel_t *tw, edp_timer_t *tm){
+    struct list_head	*slot;
+    uint64_t		delta, expire;
+    int			level, shift;
+
+    if(tm->et_expire < tw->tw_now)
+	tm->et_expire = tw->tw_now;
+
+    expire = tm->et_expire;
+    delta = expire - tw->tw_now;
+
+    if(delta < kTIMER_ROOT_SIZE){
+	slot = &tw->tw_root[expire & (kTIMER_ROOT_SIZE - 1)];
+    }else{
+	for(level = 0; level < kTIMER_LEVELS - 1; level++){
+	    if(delta < (1ULL << timer_level_shift(level + 1)))
+		break;
+	}
+
+	// too far away, wait in the last slot of the top level
+	shift = timer_level_shift(level);
+	if(delta >= (1ULL << (shift + kTIMER_LEVEL_BITS)))
+	    expire = tw->tw_now + (1ULL << (shift + kTIMER_LEVEL_BITS)) - 1;
+
+	slot = &tw->tw_levels[level][(expire >> shift) & (kTIMER_LEVEL_SIZE - 1)];
+    }
+
+    list_add_tail(&tm->et_node, slot);
+}
+
+void timer_wheel_add(timer_wheel_t *tw, edp_timer_t *tm){
+    ASSERT(list_empty(&tm->et_node));
+
+    timer_wheel_link(tw, tm);
+    tw->tw_count++;
+}
+
+void timer_wheel_del(timer_wheel_t *tw, edp_timer_t *tm){
+    if(list_empty(&tm->et_node))
+	return ;
+
+    list_del_init(&tm->et_node);
+    tw->tw_count--;
+}
+
+// move timers of an upper slot down, return the slot index
+static int timer_wheel_cascade(timer_wheel_t *tw, int level){
+    struct list_head	head, *pos, *n;
+    int			index;
+
+    index = (tw->tw_now >> timer_level_shift(level)) & (kTIMER_LEVEL_SIZE - 1);
+
+    INIT_LIST_HEAD(&head);
+    list_splice_init(&tw->tw_levels[level][index], &head);
+
+    list_for_each_safe(pos, n, &head){
+	list_del_init(pos);
+	timer_wheel_link(tw, list_entry(pos, edp_timer_t, et_node));
+    }
+
+    return index;
+}
+
+uint64_t timer_wheel_next(timer_wheel_t *tw){
+    uint64_t	next = (uint64_t)-1, tick, width;
+    int		i, level, shift;
+
+    if(tw->tw_count == 0)
+	return 0;
+
+    for(i = 0; i < kTIMER_ROOT_SIZE; i++){
+	tick = tw->tw_now + i;
+	if(!list_empty(&tw->tw_root[tick & (kTIMER_ROOT_SIZE - 1)])){
+	    next = tick;
+	    break;
+	}
+    }
+
+    // upper slots are due when the ticks below wrap to them
+    for(level = 0; level < kTIMER_LEVELS; level++){
+	shift = timer_level_shift(level);
+	width = 1ULL << shift;
+	tick = (tw->tw_now + width - 1) & ~(width - 1);
+
+	for(i = 0; (i < kTIMER_LEVEL_SIZE) && (tick < next); i++, tick += width){
+	    if(!list_empty(&tw->tw_levels[level][(tick >> shift) & (kTIMER_LEVEL_SIZE - 1)])){
+		next = tick;
+		break;
+	    }
+	}
+    }
+
+    return next;
+}
+
+int timer_wheel_run(timer_wheel_t *tw, uint64_t now, timer_expire_cb cb, void *data){
+    struct list_head	head, *pos, *n;
+    edp_timer_t		*tm;
+    uint64_t		next;
+    int			level, num = 0;
+
+    while(tw->tw_now <= now){
+	// skip empty ticks at once
+	next = timer_wheel_next(tw);
+	if((next == 0) || (next > now)){
+	    tw->tw_now = now + 1;
+	    break;
+	}
+	tw->tw_now = next;
+
+	if((tw->tw_now & (kTIMER_ROOT_SIZE - 1)) == 0){
+	    for(level = 0; level < kTIMER_LEVELS; level++){
+		if(timer_wheel_cascade(tw, level) != 0)
+		    break;
+	    }
+	}
+
+	INIT_LIST_HEAD(&head);
+	list_splice_init(&tw->tw_root[tw->tw_now & (kTIMER_ROOT_SIZE - 1)], &head);
+	tw->tw_now++;
+
+	list_for_each_safe(pos, n, &head){
+	    list_del_init(pos);
+	    tw->tw_count--;
+
+	    tm = list_entry(pos, edp_timer_t, et_node);
+	    cb(tm, data);
+	    num++;
+	}
+    }
+
+    return num;
+}
+
@@ -5,394 +5,1978 @@
 
 #include "worker.h"
 #include "edp.h"
+#include "timer.h"
+#include "fiber.h"
 
 #include "atomic.h"
 #include "logger.h"
 #include "mcache.h"
 
-#define HIGH_NORM_RATIO	    5
+#define SHARED_CLAIM_MAX    8	// stealable events owner claims at once
+#define COST_EWMA_SHIFT	    3	// handler cost average weight: 1/8
+#define BATCH_GROUP_MAX	    16	// queues one batch flush covers
+#define EDF_HEAP_INIT	    64	// deadline heap slots at first use
+#define TIMER_CHECK_EVENTS  32	// events run between two timer & io checks
+#define AGING_SCAN_MAX	    8	// aged events looked at per queue & event
+#define SHED_HOOK_MAX	    4	// handlers with a shed path of their own
+
+// -DWORKER_PACKED builds the layout without the cache line split, for
+// test/bench_test.c to compare against
+#ifdef WORKER_PACKED
+#define __worker_line
+#else
+#define __worker_line	    __spi_cacheline
+#endif
 
 enum worker_status{
     kWORKER_STATUS_ZERO = 0,
     kWORKER_STATUS_INIT,
     kWORKER_STATUS_RUNNING,
     kWORKER_STATUS_STOP,
+    kWORKER_STATUS_RETIRE,	// asked to leave, resize may take it back
+    kWORKER_STATUS_RETIRED,	// handing its events over, then exits
 };
 
+// how far a retired worker got with handing its events over
+enum worker_handover{
+    kWORKER_HANDOVER_NONE = 0,
+    kWORKER_HANDOVER_LATE,	// producers take back what they push
+    kWORKER_HANDOVER_DONE,	// its ordered events may move home
+};
+
+// queue management state of a NORM or IDLE queue
+typedef struct worker_codel{
+    uint64_t		wc_above;   // ns waits stay above target till, or 0
+    uint64_t		wc_next;    // ns to shed the next one at
+    uint32_t		wc_count;   // shed since dropping started
+    uint32_t		wc_last;    // wc_count when it started last time
+    int			wc_dropping;
+}worker_codel_t;
+
+// one queue per priority: producers push lock free, owner claims them all.
+// producer, thief and owner fields sit on separate cache lines.
+typedef struct worker_queue{
+    mpscq_t		wq_queue;   // pushed by any thread
+    mpscq_t		wq_shared;  // stealable events, NORM & IDLE only
+    atomic_t		wq_pending; // pushed but not claimed yet
+    int			wq_overload;// shedding, dispatch rejects
+
+    spi_spinlock_t	wq_lock __worker_line; // owner & thieves, guards wq_stealq
+    struct list_head	wq_stealq;  // stealable events in FIFO order
+    int			wq_stealn;  // events in wq_stealq
+
+    struct list_head	wq_events __worker_line; // claimed events, owner only
+    int			wq_queued;  // events in wq_events, owner only
+    atomic_t		wq_handled; // owner only
+    worker_codel_t	wq_codel;   // owner only
+    uint64_t		wq_shed;    // owner only
+}__worker_line worker_queue_t;
+
+// deadline events, pushed lock free, kept in a min heap by the owner
+typedef struct worker_edf{
+    worker_queue_t	we_wq;	    // wq_events is not used
+
+    edp_event_t		**we_heap;  // owner only
+    int			we_cap;
+
+    uint64_t		we_missed;  // finished after deadline, owner only
+}worker_edf_t;
+
+// slots are cache line aligned: producers touch the queue heads, parker
+// & timer inboxes, everything the owner writes per event is apart.
 typedef struct worker{
     spi_thread_t	wk_thread;  // thread handle
     int			wk_status;  // enum worker_status
+    int			wk_id;	    // index in wd_threads
+    int			wk_started; // thread created, not joined yet
+    int			wk_caller;  // run by the edp_loop caller, no thread
+    int			wk_break;   // edp_loop caller asked to return
+    worker_poll_cb	wk_poll;    // io of the edp_loop caller
+
+    __spi_convar_t	wk_convar;
+
+    __spi_parker_t	wk_parker __worker_line; // dispatch wakeup
+    int			wk_idle;    // waiting for events
+    mpscq_t		wk_timer_adds;	    // from other threads
+    mpscq_t		wk_timer_cancels;
+    int			wk_handover;	    // enum worker_handover
+    uint32_t		wk_gen;	    // handovers done, see __edp_home
+    spi_mutex_t		wk_reclaim; // one taking events back at a time
+
+    int			wk_drr __worker_line; // priority deficit round robin visits, owner only
+    int			wk_deficit[kEDP_EVENT_PRIORITY_MAX];
+    int			wk_timer_tick;	    // events until timer & io check
+    uint64_t		wk_timer_next;	    // ns next timer is due, owner only
+    uint64_t		wk_cost;    // recent handler time in ns, owner only
+    uint64_t		wk_sojourn; // recent queue wait in ns, owner only
+    uint64_t		wk_now;	    // ns the last event started, owner only
+    atomic_t		wk_stolen;  // events stolen from siblings
+    uint64_t		wk_promoted;// aged events moved up, owner only
+
+    worker_queue_t	wk_queues[kEDP_EVENT_PRIORITY_MAX];
+    worker_edf_t	wk_edf;
+
+    timer_wheel_t	wk_wheel;   // owner only
+
+    histo_t		wk_wait[kEDP_EVENT_PRIORITY_MAX];   // queued time
+    histo_t		wk_run[kEDP_EVENT_PRIORITY_MAX];    // handler time
+}__worker_line worker_t;
+
+typedef struct worker_data{
+    int			wd_init;
+    int			wd_thread_num;	// active workers
+    int			wd_thread_max;	// worker slots
+    int			wd_thread_min;	// autoscaler lower bound
+    spi_mutex_t		wd_lock;	// resize
+    int			wd_loop;    // edp_loop caller runs worker 0
+    int			wd_looping; // and it is in there now
+    int			wd_select;  // enum edp_select_policy
+    uint64_t		wd_spin;    // ns to spin before park
+    int			wd_weights[kEDP_EVENT_PRIORITY_MAX];
+    worker_t		*wd_threads;
+
+    int			wd_stamp;   // stamp events to measure sojourn
+    int			wd_latency; // record latency histograms
+    int			wd_scaling; // autoscaler is running
+    int			wd_scale_ms;
+    uint64_t		wd_sojourn; // ns
+    uint64_t		wd_idle_ns;
+    uint64_t		wd_codel_target;    // ns, 0 for off
+    uint64_t		wd_codel_interval;  // ns
+    uint64_t		wd_aging;   // ns, 0 for off
+    spi_thread_t	wd_scaler;
+    __spi_convar_t	wd_scaler_cv;
+
+    // bumped on every dispatch and every park, keep them apart
+    atomic_t		wd_round __worker_line;
+    atomic_t		wd_idle __worker_line;    // idle workers number
+}worker_data_t;
+
+// shed events of these handlers go to their shed path
+typedef struct worker_shed_hook{
+    edp_event_handler	ws_handler;
+    edp_event_handler	ws_shed;
+}worker_shed_hook_t;
+
+static worker_data_t  __worker_data = {};
+static __thread worker_t    *__worker_self = NULL;
+
+static worker_shed_hook_t   __worker_shed[SHED_HOOK_MAX] = {};
+static int		    __worker_shed_num = 0;
+
+static inline worker_data_t *get_data(){
+    return &__worker_data;
+}
+
+static inline int worker_stealable(edp_event_t *ev){
+    return (ev->ev_priority <= kEDP_EVENT_PRIORITY_NORM) &&
+	(!(ev->ev_flags & kEDP_EVENT_FLAG_ORDERED));
+}
+
+// queue management of priority prio may shed or reject it. completions
+// of canceled ones are kept, they end a timer.
+static inline int worker_sheddable(edp_event_t *ev, int prio){
+    return (prio <= kEDP_EVENT_PRIORITY_NORM) && (ev->ev_deadline == 0) &&
+	(!(ev->ev_flags & (kEDP_EVENT_FLAG_ORDERED | kEDP_EVENT_FLAG_KEEP |
+			   kEDP_EVENT_FLAG_CANCELED)));
+}
+
+// complete a shed event with -kEDP_ERR_OVERLOAD, its handler never runs
+static void worker_shed(edp_event_t *ev){
+    int		    i;
+
+    for(i = 0; i < __worker_shed_num; i++){
+	if(__worker_shed[i].ws_handler == ev->ev_handler){
+	    __worker_shed[i].ws_shed(ev->ev_emit, ev);
+	    return ;
+	}
+    }
+
+    edp_event_done(ev, -kEDP_ERR_OVERLOAD);
+}
+
+int __edp_shed_hook(edp_event_handler handler, edp_event_handler shed){
+    int		    i;
+
+    for(i = 0; i < __worker_shed_num; i++){
+	if(__worker_shed[i].ws_handler == handler){
+	    __worker_shed[i].ws_shed = shed;
+	    return 0;
+	}
+    }
+
+    if(__worker_shed_num == SHED_HOOK_MAX){
+	return -ENOSPC;
+    }
+
+    __worker_shed[i].ws_handler = handler;
+    __worker_shed[i].ws_shed = shed;
+    __worker_shed_num++;
+
+    return 0;
+}
+
+static uint64_t worker_isqrt(uint64_t x){
+    uint64_t	r = x, y;
+
+    if(x < 2)
+	return x;
+
+    for(y = (r + 1) / 2; y < r; y = (r + x / r) / 2)
+	r = y;
+
+    return r;
+}
+
+// interval / sqrt(count) after t
+static inline uint64_t worker_codel_next(uint64_t t, uint32_t count){
+    return t + (get_data()->wd_codel_interval << 8) / worker_isqrt((uint64_t)count << 16);
+}
+
+// CoDel: shed an event once waits stayed above target for an interval,
+// then shed faster until a wait falls below it. return 1 to shed ev.
+static int worker_codel(worker_queue_t *wq, uint64_t wait, uint64_t now){
+    worker_data_t   *wd = get_data();
+    worker_codel_t  *wc = &wq->wq_codel;
+    uint32_t	    delta;
+    int		    above = 0;
+
+    if(wait < wd->wd_codel_target){
+	wc->wc_above = 0;
+    }else if(wc->wc_above == 0){
+	wc->wc_above = now + wd->wd_codel_interval;
+    }else if(now >= wc->wc_above){
+	above = 1;
+    }
+
+    if(wc->wc_dropping){
+	if(!above){
+	    wc->wc_dropping = 0;
+	    wq->wq_overload = 0;
+	    return 0;
+	}
+
+	if(now < wc->wc_next)
+	    return 0;
+
+	wc->wc_count++;
+	wc->wc_next = worker_codel_next(wc->wc_next, wc->wc_count);
+	wq->wq_shed++;
+	return 1;
+    }
+
+    if(!above)
+	return 0;
+
+    // shed lately, start near the rate it ended at
+    delta = wc->wc_count - wc->wc_last;
+    if((delta > 1) && ((int64_t)(now - wc->wc_next) < (int64_t)(16 * wd->wd_codel_interval))){
+	wc->wc_count = delta;
+    }else{
+	wc->wc_count = 1;
+    }
+    wc->wc_last = wc->wc_count;
+    wc->wc_next = worker_codel_next(now, wc->wc_count);
+    wc->wc_dropping = 1;
+    wq->wq_overload = 1;
+    wq->wq_shed++;
+
+    return 1;
+}
+
+// queues are empty, nothing waits too long any more
+static void worker_codel_reset(worker_t *wkr){
+    worker_queue_t  *wq;
+    int		    prio;
+
+    for(prio = kEDP_EVENT_PRIORITY_IDLE; prio <= kEDP_EVENT_PRIORITY_NORM; prio++){
+	wq = &wkr->wk_queues[prio];
+	wq->wq_codel.wc_above = 0;
+	if(wq->wq_codel.wc_dropping){
+	    wq->wq_codel.wc_dropping = 0;
+	    wq->wq_overload = 0;
+	}
+    }
+}
+
+static inline void worker_do_event(worker_t *wkr, edp_event_t *ev){
+    worker_data_t   *wd = get_data();
+    uint64_t	    deadline, stamp, wait, start = 0, now;
+    int		    prio, timed;
+
+    ASSERT((ev != NULL) && (ev->ev_handler != NULL));
+
+    // ev may be gone after handler
+    deadline = ev->ev_deadline;
+    stamp = ev->ev_stamp;
+    prio = ev->ev_priority;
+    timed = (wd->wd_select == kEDP_SELECT_P2C) || wd->wd_latency;
+
+    if(timed || (stamp != 0)){
+	start = spi_time_now();
+	wkr->wk_now = start;
+	if(stamp != 0){
+	    wait = start > stamp ? start - stamp : 0;
+	    wkr->wk_sojourn += ((int64_t)wait - (int64_t)wkr->wk_sojourn) >> COST_EWMA_SHIFT;
+	    if(wd->wd_latency)
+		histo_record(&wkr->wk_wait[prio], wait);
+
+	    if((wd->wd_codel_target > 0) && worker_sheddable(ev, prio) &&
+		    worker_codel(&wkr->wk_queues[prio], wait, start)){
+		worker_shed(ev);
+		return ;
+	    }
+	}
+    }
+
+    ev->ev_handler(ev->ev_emit, ev);
+
+    if((!timed) && (deadline == 0))
+	return ;
+
+    now = spi_time_now();
+
+    if(wd->wd_select == kEDP_SELECT_P2C)
+	wkr->wk_cost += ((int64_t)(now - start) - (int64_t)wkr->wk_cost) >> COST_EWMA_SHIFT;
+
+    if(wd->wd_latency)
+	histo_record(&wkr->wk_run[prio], now - start);
+
+    if((deadline != 0) && (now > deadline))
+	wkr->wk_edf.we_missed++;
+}
+
+// estimated time to drain all events of a worker, read without locks
+static uint64_t worker_load(worker_t *wkr){
+    worker_queue_t  *wq;
+    uint64_t	    depth;
+    int		    i;
+
+    depth = wkr->wk_idle ? 0 : 1;
+    for(i = 0; i < kEDP_EVENT_PRIORITY_MAX; i++){
+	wq = &wkr->wk_queues[i];
+	depth += wq->wq_pending + wq->wq_queued;
+    }
+    depth += wkr->wk_edf.we_wq.wq_pending + wkr->wk_edf.we_wq.wq_queued;
+
+    return depth * (wkr->wk_cost + 1);
+}
+
+static inline uint32_t worker_random(){
+    static __thread uint32_t	seed = 0;
+
+    if(seed == 0)
+	seed = (uint32_t)(spi_time_now() ^ (uintptr_t)&seed) | 1;
+
+    // xorshift32
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    return seed;
+}
+
+static inline int worker_queue_ready(worker_queue_t *wq){
+    return (!list_empty(&wq->wq_events)) || (!mpscq_empty(&wq->wq_queue))
+	|| (!mpscq_empty(&wq->wq_shared)) || (wq->wq_stealn > 0);
+}
+
+// append a grabbed chain to owner's list
+static int worker_queue_append(worker_queue_t *wq, mpscq_node_t *node){
+    mpscq_node_t    *next;
+    edp_event_t	    *ev;
+    int		    num = 0;
+
+    while(node != NULL){
+	next = node->next;  // ev_node shares memory with ev_qnode
+	ev = container_of(node, edp_event_t, ev_qnode);
+	list_add_tail(&ev->ev_node, &wq->wq_events);
+	node = next;
+	num++;
+    }
+    wq->wq_queued += num;
+
+    return num;
+}
+
+// take the oldest stealable events of wq to dst, at most half of them
+// for a thief. returns events taken, -1 if a thief lost the lock. the
+// owner never waits for a thief either, it leaves them for this time and
+// worker_queue_ready still sees them.
+static int worker_shared_take(worker_queue_t *wq, worker_queue_t *dst,
+	int thief, int *left){
+    mpscq_node_t    *node, *next;
+    edp_event_t	    *ev;
+    int		    num, i;
+
+    if(mpscq_empty(&wq->wq_shared) && (wq->wq_stealn == 0))
+	return 0;
+
+    if(spi_spin_trylock(&wq->wq_lock) != 0)
+	return thief ? -1 : 0;
+
+    // newly pushed events go behind the older ones
+    node = mpscq_grab(&wq->wq_shared);
+    while(node != NULL){
+	next = node->next;  // ev_node shares memory with ev_qnode
+	ev = container_of(node, edp_event_t, ev_qnode);
+	list_add_tail(&ev->ev_node, &wq->wq_stealq);
+	wq->wq_stealn++;
+	node = next;
+    }
+
+    num = thief ? (wq->wq_stealn + 1) / 2 : wq->wq_stealn;
+    if(num > SHARED_CLAIM_MAX)
+	num = SHARED_CLAIM_MAX;
+
+    for(i = 0; i < num; i++){
+	ev = list_first_entry(&wq->wq_stealq, edp_event_t, ev_node);
+	list_move_tail(&ev->ev_node, &dst->wq_events);
+    }
+    wq->wq_stealn -= num;
+
+    if(left != NULL)
+	*left = wq->wq_stealn;
+
+    spi_spin_unlock(&wq->wq_lock);
+
+    dst->wq_queued += num;
+    if(num > 0)
+	atomic_sub(&wq->wq_pending, num);
+
+    return num;
+}
+
+// move pushed events to owner's list, keep them in FIFO order
+static int worker_queue_claim(worker_queue_t *wq){
+    int		    num, shared;
+
+    num  = worker_queue_append(wq, mpscq_grab(&wq->wq_queue));
+    if(num > 0)
+	atomic_sub(&wq->wq_pending, num);
+
+    // leave the rest of stealable events to idle siblings
+    shared = worker_shared_take(wq, wq, 0, NULL);
+
+    return num + shared;
+}
+
+static edp_event_t *worker_queue_pop(worker_queue_t *wq){
+    edp_event_t	    *ev;
+
+    if(list_empty(&wq->wq_events)){
+	if(worker_queue_claim(wq) == 0)
+	    return NULL;
+    }
+
+    ev = list_first_entry(&wq->wq_events, edp_event_t, ev_node);
+    list_del(&ev->ev_node);
+    wq->wq_queued--;
+    wq->wq_handled++;
+
+    return ev;
+}
+
+static inline int worker_edf_before(edp_event_t *a, edp_event_t *b){
+    return a->ev_deadline < b->ev_deadline;
+}
+
+static int worker_edf_insert(worker_edf_t *we, edp_event_t *ev){
+    edp_event_t	    **heap;
+    int		    i, p;
+
+    if(we->we_wq.wq_queued == we->we_cap){
+	p = (we->we_cap > 0) ? we->we_cap * 2 : EDF_HEAP_INIT;
+	heap = mheap_alloc(sizeof(*heap) * p);
+	if(heap == NULL){
+	    return -ENOMEM;
+	}
+
+	if(we->we_heap != NULL){
+	    memcpy(heap, we->we_heap, sizeof(*heap) * we->we_cap);
+	    mheap_free(we->we_heap);
+	}
+
+	we->we_heap = heap;
+	we->we_cap = p;
+    }
+
+    heap = we->we_heap;
+    for(i = we->we_wq.wq_queued++; i > 0; i = p){
+	p = (i - 1) / 2;
+	if(!worker_edf_before(ev, heap[p]))
+	    break;
+	heap[i] = heap[p];
+    }
+    heap[i] = ev;
+
+    return 0;
+}
+
+// earliest deadline first
+static edp_event_t *worker_edf_pop(worker_t *wkr){
+    worker_edf_t    *we = &wkr->wk_edf;
+    edp_event_t	    **heap = we->we_heap;
+    edp_event_t	    *ev, *last;
+    mpscq_node_t    *node, *next;
+    int		    i, c, num = 0, size;
+
+    node = mpscq_grab(&we->we_wq.wq_queue);
+    while(node != NULL){
+	next = node->next;
+	ev = container_of(node, edp_event_t, ev_qnode);
+	if(worker_edf_insert(we, ev) != 0){
+	    // no room, serve the rest as HIGH events anyway
+	    log_warn("deadline heap full!\n");
+	    num += worker_queue_append(&wkr->wk_queues[kEDP_EVENT_PRIORITY_HIGH], node);
+	    break;
+	}
+	heap = we->we_heap;
+	node = next;
+	num++;
+    }
+    if(num > 0)
+	atomic_sub(&we->we_wq.wq_pending, num);
+
+    size = we->we_wq.wq_queued;
+    if(size == 0)
+	return NULL;
+
+    ev = heap[0];
+    last = heap[--size];
+    for(i = 0; (c = i * 2 + 1) < size; i = c){
+	if((c + 1 < size) && worker_edf_before(heap[c + 1], heap[c]))
+	    c++;
+	if(!worker_edf_before(heap[c], last))
+	    break;
+	heap[i] = heap[c];
+    }
+    heap[i] = last;
+
+    we->we_wq.wq_queued = size;
+    we->we_wq.wq_handled++;
+
+    return ev;
+}
+
+// deficit round robin over priorities with non zero weight: a visited
+// queue gets weight more events, an empty one loses what it had left
+static edp_event_t *worker_drr_next(worker_t *wkr){
+    worker_data_t   *wd = get_data();
+    worker_queue_t  *wq;
+    edp_event_t	    *ev;
+    int		    prio, n;
+
+    for(n = 0; n <= kEDP_EVENT_PRIORITY_MAX; n++){
+	prio = wkr->wk_drr;
+	wq = &wkr->wk_queues[prio];
+
+	if((wd->wd_weights[prio] > 0) && worker_queue_ready(wq)){
+	    if(wkr->wk_deficit[prio] <= 0)
+		wkr->wk_deficit[prio] = wd->wd_weights[prio];
+
+	    ev = worker_queue_pop(wq);
+	    if(ev != NULL){
+		if(--wkr->wk_deficit[prio] > 0)
+		    return ev;
+
+		wkr->wk_drr = (prio + kEDP_EVENT_PRIORITY_MAX - 1) % kEDP_EVENT_PRIORITY_MAX;
+		return ev;
+	    }
+	}
+
+	wkr->wk_deficit[prio] = 0;
+	wkr->wk_drr = (prio + kEDP_EVENT_PRIORITY_MAX - 1) % kEDP_EVENT_PRIORITY_MAX;
+    }
+
+    return NULL;
+}
+
+// claimed NORM & IDLE events move up one priority per wd_aging they
+// waited, to the tail of the next queue. queues are FIFO, so only their
+// heads are looked at. ordered events stay, moving some of an emitter's
+// events but not the others would break their order.
+static void worker_age(worker_t *wkr){
+    worker_data_t   *wd = get_data();
+    worker_queue_t  *wq, *up;
+    edp_event_t	    *ev, *n;
+    uint64_t	    age;
+    int		    prio, num;
+
+    for(prio = kEDP_EVENT_PRIORITY_NORM; prio >= kEDP_EVENT_PRIORITY_IDLE; prio--){
+	wq = &wkr->wk_queues[prio];
+	up = &wkr->wk_queues[prio + 1];
+
+	if(list_empty(&wq->wq_events) &&
+		((!worker_queue_ready(wq)) || (worker_queue_claim(wq) == 0))){
+	    continue;
+	}
+
+	num = 0;
+	list_for_each_entry_safe(ev, n, &wq->wq_events, ev_node){
+	    if((ev->ev_stamp == 0) || (wkr->wk_now <= ev->ev_stamp))
+		break;
+
+	    // promoted ones need another period per level
+	    age = wd->wd_aging * (prio - ev->ev_priority + 1);
+	    if(wkr->wk_now - ev->ev_stamp < age)
+		break;
+
+	    if(++num > AGING_SCAN_MAX)
+		break;
+
+	    if(ev->ev_flags & kEDP_EVENT_FLAG_ORDERED)
+		continue;
+
+	    list_move_tail(&ev->ev_node, &up->wq_events);
+	    wq->wq_queued--;
+	    up->wq_queued++;
+	    wkr->wk_promoted++;
+	}
+    }
+}
+
+// priorities of weight 0 are strict from CRIT down, deadline events come
+// next, the rest share the worker by weight and none of them starves
+static edp_event_t *worker_next_event(worker_t *wkr){
+    worker_data_t   *wd = get_data();
+    edp_event_t	    *ev;
+    int		    prio;
+
+    if(wd->wd_aging > 0)
+	worker_age(wkr);
+
+    for(prio = kEDP_EVENT_PRIORITY_CRIT; prio >= kEDP_EVENT_PRIORITY_IDLE; prio--){
+	if(wd->wd_weights[prio] > 0)
+	    continue;
+
+	ev = worker_queue_pop(&wkr->wk_queues[prio]);
+	if(ev != NULL)
+	    return ev;
+    }
+
+    ev = worker_edf_pop(wkr);
+    if(ev != NULL)
+	return ev;
+
+    return worker_drr_next(wkr);
+}
+
+// wake one idle sibling of wkr, it will steal from the busy one
+static void worker_wake_idle(worker_t *busy){
+    worker_data_t   *wd = get_data();
+    worker_t	    *wkr;
+    int		    i;
+
+    for(i = 1; i < wd->wd_thread_num; i++){
+	wkr = &(wd->wd_threads[(busy->wk_id + i) % wd->wd_thread_num]);
+	if(wkr->wk_idle){
+	    __spi_parker_unpark(&wkr->wk_parker);
+	    return ;
+	}
+    }
+}
+
+// take up to half of a sibling's unclaimed NORM or IDLE events
+static edp_event_t *worker_steal(worker_t *wkr){
+    worker_data_t   *wd = get_data();
+    worker_queue_t  *vq;
+    int		    prio, i, keep, left;
+
+    for(prio = kEDP_EVENT_PRIORITY_NORM; prio >= kEDP_EVENT_PRIORITY_IDLE; prio--){
+	for(i = 1; i < wd->wd_thread_num; i++){
+	    vq = &(wd->wd_threads[(wkr->wk_id + i) % wd->wd_thread_num].wk_queues[prio]);
+
+	    keep = worker_shared_take(vq, &wkr->wk_queues[prio], 1, &left);
+	    if(keep <= 0)
+		continue;
+
+	    // still loaded, pass the chance to another idle sibling
+	    if((left > 0) && (wd->wd_idle > 0))
+		worker_wake_idle(wkr);
+
+	    atomic_add(&wkr->wk_stolen, keep);
+
+	    return worker_queue_pop(&wkr->wk_queues[prio]);
+	}
+    }
+
+    return NULL;
+}
+
+static int worker_queues_ready(worker_t *wkr){
+    worker_queue_t  *we = &wkr->wk_edf.we_wq;
+    int		    i;
+
+    for(i = 0; i < kEDP_EVENT_PRIORITY_MAX; i++){
+	if(worker_queue_ready(&wkr->wk_queues[i]))
+	    return 1;
+    }
+
+    return (we->wq_queued > 0) || (!mpscq_empty(&we->wq_queue));
+}
+
+static int worker_has_event(worker_t *wkr){
+    return worker_queues_ready(wkr) ||
+	(!mpscq_empty(&wkr->wk_timer_adds)) || (!mpscq_empty(&wkr->wk_timer_cancels));
+}
+
+// poll own queues for wd_spin ns before parking
+static int worker_spin(worker_t *wkr){
+    worker_data_t   *wd = get_data();
+    uint64_t	    start = 0, now;
+    int		    i;
+
+    if(wd->wd_spin == 0)
+	return 0;
+
+    for(i = 0; ; i++){
+	if(worker_has_event(wkr))
+	    return 1;
+
+	if((i & 63) == 0){
+	    now = spi_time_now();
+	    if(start == 0){
+		start = now;
+	    }else if(now - start > wd->wd_spin){
+		return 0;
+	    }
+	}
+	spi_cpu_relax();
+    }
+
+    return 0;
+}
+
+// queues live as long as the slot, a restarted worker takes over what
+// was pushed to it meanwhile
+static void worker_init_slot(worker_t *wkr, int id){
+    worker_queue_t  *wq;
+    int		    i;
+
+    wkr->wk_id = id;
+    __spi_parker_init(&wkr->wk_parker);
+    spi_mutex_init(&wkr->wk_reclaim);
+
+    for(i = 0; i < kEDP_EVENT_PRIORITY_MAX; i++){
+	wq = &wkr->wk_queues[i];
+	mpscq_init(&wq->wq_queue);
+	mpscq_init(&wq->wq_shared);
+	spi_spin_init(&wq->wq_lock);
+	INIT_LIST_HEAD(&wq->wq_stealq);
+	INIT_LIST_HEAD(&wq->wq_events);
+    }
+
+    mpscq_init(&wkr->wk_edf.we_wq.wq_queue);
+    mpscq_init(&wkr->wk_edf.we_wq.wq_shared);
+    INIT_LIST_HEAD(&wkr->wk_edf.we_wq.wq_events);
+
+    timer_wheel_init(&wkr->wk_wheel, spi_time_now() / 1000000);
+    mpscq_init(&wkr->wk_timer_adds);
+    mpscq_init(&wkr->wk_timer_cancels);
+}
+
+static void worker_fini_slot(worker_t *wkr){
+    int		    i;
+
+    for(i = 0; i < kEDP_EVENT_PRIORITY_MAX; i++){
+	spi_spin_fini(&wkr->wk_queues[i].wq_lock);
+    }
+
+    spi_mutex_fini(&wkr->wk_reclaim);
+}
+
+static int worker_init_tls(worker_t *wkr){
+    int		    i;
+
+    ASSERT(wkr != NULL);
+
+    wkr->wk_drr = kEDP_EVENT_PRIORITY_MAX - 1;
+    for(i = 0; i < kEDP_EVENT_PRIORITY_MAX; i++){
+	wkr->wk_deficit[i] = 0;
+    }
+    wkr->wk_cost = 0;
+    wkr->wk_sojourn = 0;
+    wkr->wk_timer_tick = 0;
+    wkr->wk_timer_next = (uint64_t)-1;
+
+    __worker_self = wkr;
+
+    return 0;
+}
+
+static int worker_fini_tls(worker_t *wkr){
+    ASSERT(wkr!= NULL);
+
+    if((wkr->wk_status != kWORKER_STATUS_STOP) &&
+	    (wkr->wk_status != kWORKER_STATUS_RETIRED)){
+	return -1;
+    }
+
+    if(wkr->wk_edf.we_heap != NULL){
+	mheap_free(wkr->wk_edf.we_heap);
+	wkr->wk_edf.we_heap = NULL;
+	wkr->wk_edf.we_cap = 0;
+    }
+
+    __worker_self = NULL;
+    __fiber_drain();
+    edp_event_drain();
+
+    // a retired one keeps its status until a resize starts it again
+    if(wkr->wk_status == kWORKER_STATUS_STOP)
+	wkr->wk_status = kWORKER_STATUS_ZERO;
+
+    return 0;
+}
+
+/*
+ * timers: the owner keeps them in its wheel, others send requests
+ */
+static void worker_check_retired(worker_t *wkr);
+static int worker_dispatch(edp_event_t *ev, int admit);
+
+// a canceled timer completes once both add & cancel requests are taken
+static void worker_timer_complete(edp_timer_t *tm){
+    tm->et_event.ev_flags |= kEDP_EVENT_FLAG_CANCELED;
+    worker_dispatch(&tm->et_event, 0);
+}
+
+static void worker_timer_expire(edp_timer_t *tm, void *data){
+    worker_t	*wkr = (worker_t *)data;
+
+    // canceled meanwhile, its cancel request completes it
+    if(!__sync_bool_compare_and_swap(&tm->et_state, kEDP_TIMER_ARMED, kEDP_TIMER_FIRED))
+	return ;
+
+    if(tm->et_event.ev_cpuid < 0)
+	tm->et_event.ev_cpuid = wkr->wk_id;
+
+    worker_dispatch(&tm->et_event, 0);
+}
+
+static void worker_timer_link(worker_t *wkr, edp_timer_t *tm, uint64_t now){
+    // an empty wheel may be far behind
+    if(wkr->wk_wheel.tw_count == 0)
+	wkr->wk_wheel.tw_now = now;
+
+    timer_wheel_add(&wkr->wk_wheel, tm);
+
+    if(tm->et_expire * 1000000 < wkr->wk_timer_next)
+	wkr->wk_timer_next = tm->et_expire * 1000000;
+}
+
+static void worker_timer_inbox(worker_t *wkr){
+    mpscq_node_t    *node, *next;
+    edp_timer_t	    *tm;
+    uint64_t	    now = spi_time_now() / 1000000;
+
+    for(node = mpscq_grab(&wkr->wk_timer_adds); node != NULL; node = next){
+	next = node->next;
+	tm = container_of(node, edp_timer_t, et_qnode);
+
+	tm->et_seen = 1;
+	if(tm->et_state == kEDP_TIMER_ARMED){
+	    worker_timer_link(wkr, tm, now);
+	}else if(tm->et_noted){
+	    worker_timer_complete(tm);
+	}
+    }
+
+    for(node = mpscq_grab(&wkr->wk_timer_cancels); node != NULL; node = next){
+	next = node->next;
+	tm = container_of(node, edp_timer_t, et_cnode);
+
+	tm->et_noted = 1;
+	if(tm->et_seen){
+	    timer_wheel_del(&wkr->wk_wheel, tm);
+	    worker_timer_complete(tm);
+	}
+    }
+}
+
+// take requests, fire due timers, return ms until the next one or -1
+static int worker_timer_run(worker_t *wkr){
+    timer_wheel_t   *tw = &wkr->wk_wheel;
+    uint64_t	    now, next;
+
+    wkr->wk_timer_tick = TIMER_CHECK_EVENTS;
+    wkr->wk_timer_next = (uint64_t)-1;
+
+    if((!mpscq_empty(&wkr->wk_timer_adds)) || (!mpscq_empty(&wkr->wk_timer_cancels)))
+	worker_timer_inbox(wkr);
+
+    if(tw->tw_count == 0)
+	return -1;
+
+    now = spi_time_now() / 1000000;
+    timer_wheel_run(tw, now, worker_timer_expire, wkr);
+
+    next = timer_wheel_next(tw);
+    if(next == 0)
+	return -1;
+
+    wkr->wk_timer_next = next * 1000000;
+
+    if(next <= now)
+	return 0;
+
+    return (next - now) > 0x7fffffff ? 0x7fffffff : (int)(next - now);
+}
+
+// requests to a retired worker go on to worker 0, a cancel has to reach
+// the wheel its add went to
+static void worker_timer_forward(worker_t *wkr, edp_timer_t *tm, int cancel){
+    worker_data_t   *wd = get_data();
+    worker_t	    *to;
+
+    to = &wd->wd_threads[0];
+    if(cancel){
+	mpscq_push(&to->wk_timer_cancels, &tm->et_cnode);
+    }else{
+	tm->et_seen = 0;
+	tm->et_cpuid = to->wk_id;
+	mpscq_push(&to->wk_timer_adds, &tm->et_qnode);
+    }
+
+    __spi_parker_unpark(&to->wk_parker);
+
+    worker_check_retired(to);
+}
+
+static void worker_timer_reclaim(worker_t *wkr){
+    mpscq_node_t    *node, *next;
+
+    for(node = mpscq_grab(&wkr->wk_timer_adds); node != NULL; node = next){
+	next = node->next;
+	worker_timer_forward(wkr, container_of(node, edp_timer_t, et_qnode), 0);
+    }
+
+    for(node = mpscq_grab(&wkr->wk_timer_cancels); node != NULL; node = next){
+	next = node->next;
+	worker_timer_forward(wkr, container_of(node, edp_timer_t, et_cnode), 1);
+    }
+}
+
+static void worker_timer_handover(worker_t *wkr){
+    timer_wheel_t	*tw = &wkr->wk_wheel;
+    struct list_head	*slot;
+    edp_timer_t		*tm;
+    int			i, num;
+
+    num = kTIMER_ROOT_SIZE + kTIMER_LEVELS * kTIMER_LEVEL_SIZE;
+    for(i = 0; (i < num) && (tw->tw_count > 0); i++){
+	slot = (i < kTIMER_ROOT_SIZE) ? &tw->tw_root[i] :
+	    &tw->tw_levels[(i - kTIMER_ROOT_SIZE) / kTIMER_LEVEL_SIZE][(i - kTIMER_ROOT_SIZE) % kTIMER_LEVEL_SIZE];
+
+	while(!list_empty(slot)){
+	    tm = list_first_entry(slot, edp_timer_t, et_node);
+	    timer_wheel_del(tw, tm);
+	    worker_timer_forward(wkr, tm, 0);
+	}
+    }
+}
+
+int edp_timer_add(edp_timer_t *tm, uint32_t ms){
+    worker_data_t   *wd = get_data();
+    worker_t	    *wkr, *self = __worker_self;
+    uint64_t	    now;
+    int		    cpuid;
+
+    ASSERT(tm != NULL);
+
+    if((!wd->wd_init) || (tm->et_event.ev_handler == NULL)){
+	return -EINVAL;
+    }
+
+    if(tm->et_state == kEDP_TIMER_ARMED){
+	return -EBUSY;
+    }
+
+    // round up, never fire early
+    now = (spi_time_now() + 999999) / 1000000;
+    tm->et_expire = now + ms;
+    tm->et_seen = 0;
+    tm->et_noted = 0;
+    tm->et_event.ev_flags &= ~kEDP_EVENT_FLAG_CANCELED;
+
+    cpuid = tm->et_event.ev_cpuid;
+    if((self != NULL) && (self->wk_id < wd->wd_thread_num)){
+	cpuid = self->wk_id;
+    }else if((cpuid < 0) || (cpuid >= wd->wd_thread_num)){
+	cpuid = __edp_select();
+    }
+    tm->et_cpuid = cpuid;
+    wkr = &wd->wd_threads[cpuid];
+
+    __atomic_store_n(&tm->et_state, kEDP_TIMER_ARMED, __ATOMIC_SEQ_CST);
+
+    if(wkr == self){
+	tm->et_seen = 1;
+	worker_timer_link(wkr, tm, now);
+	return 0;
+    }
+
+    mpscq_push(&wkr->wk_timer_adds, &tm->et_qnode);
+    __spi_parker_unpark(&wkr->wk_parker);
+
+    worker_check_retired(wkr);
+
+    return 0;
+}
+
+int edp_timer_cancel(edp_timer_t *tm){
+    worker_data_t   *wd = get_data();
+    worker_t	    *wkr;
+
+    ASSERT(tm != NULL);
+
+    if(!__sync_bool_compare_and_swap(&tm->et_state, kEDP_TIMER_ARMED, kEDP_TIMER_CANCELED)){
+	return -ENOENT;
+    }
+
+    wkr = &wd->wd_threads[tm->et_cpuid];
+    if((wkr == __worker_self) && tm->et_seen){
+	tm->et_noted = 1;
+	timer_wheel_del(&wkr->wk_wheel, tm);
+	worker_timer_complete(tm);
+	return 0;
+    }
+
+    mpscq_push(&wkr->wk_timer_cancels, &tm->et_cnode);
+    __spi_parker_unpark(&wkr->wk_parker);
+
+    worker_check_retired(wkr);
+
+    return 0;
+}
+
+// resize may take a retire request back before the worker sees it
+static inline int worker_running(worker_t *wkr){
+    if(wkr->wk_status == kWORKER_STATUS_RUNNING)
+	return 1;
+
+    if(wkr->wk_status == kWORKER_STATUS_RETIRE){
+	return !__sync_bool_compare_and_swap(&wkr->wk_status,
+		kWORKER_STATUS_RETIRE, kWORKER_STATUS_RETIRED);
+    }
+
+    return 0;
+}
+
+// events of a retired worker go to the active ones, ordered events go to
+// worker 0, which never retires. an heir picked by the workers left would
+// change as they come and go, and split the events of one emitter.
+static void worker_redispatch(worker_t *wkr, edp_event_t *ev){
+    if(ev->ev_flags & kEDP_EVENT_FLAG_ORDERED){
+	ev->ev_cpuid = 0;
+    }else{
+	ev->ev_cpuid = -1;
+    }
+
+    worker_dispatch(ev, 0);
+}
+
+static int worker_chain_redispatch(worker_t *wkr, worker_queue_t *wq, mpscq_t *mq){
+    mpscq_node_t    *node, *next;
+    int		    num = 0;
+
+    node = mpscq_grab(mq);
+    while(node != NULL){
+	next = node->next;
+	worker_redispatch(wkr, container_of(node, edp_event_t, ev_qnode));
+	node = next;
+	num++;
+    }
+
+    if(num > 0)
+	atomic_sub(&wq->wq_pending, num);
+
+    return num;
+}
+
+// a producer pushed to a retired worker, take back what it left there.
+// one at a time, or a producer's later event could pass its earlier one
+static void worker_reclaim(worker_t *wkr){
+    worker_queue_t  *wq;
+    int		    i;
+
+    spi_mutex_lock(&wkr->wk_reclaim);
+
+    for(i = kEDP_EVENT_PRIORITY_MAX - 1; i >= 0; i--){
+	wq = &wkr->wk_queues[i];
+	worker_chain_redispatch(wkr, wq, &wq->wq_queue);
+	worker_chain_redispatch(wkr, wq, &wq->wq_shared);
+    }
+
+    wq = &wkr->wk_edf.we_wq;
+    worker_chain_redispatch(wkr, wq, &wq->wq_queue);
+
+    worker_timer_reclaim(wkr);
+
+    spi_mutex_unlock(&wkr->wk_reclaim);
+}
+
+// after a push: raced with a shrink, the worker may be gone already
+static void worker_check_retired(worker_t *wkr){
+    if(__atomic_load_n(&wkr->wk_handover, __ATOMIC_SEQ_CST) != kWORKER_HANDOVER_NONE)
+	worker_reclaim(wkr);
+}
+
+// retired worker moves all its events away before it exits
+static void worker_handover(worker_t *wkr){
+    worker_edf_t    *we = &wkr->wk_edf;
+    worker_queue_t  *wq;
+    edp_event_t	    *ev;
+    int		    i;
+
+    // a thief holding the lock makes a claim skip its events, go on
+    // until none are left
+    for(i = kEDP_EVENT_PRIORITY_MAX - 1; i >= 0; i--){
+	wq = &wkr->wk_queues[i];
+	while(worker_queue_ready(wq)){
+	    worker_queue_claim(wq);
+
+	    while(!list_empty(&wq->wq_events)){
+		ev = list_first_entry(&wq->wq_events, edp_event_t, ev_node);
+		list_del(&ev->ev_node);
+		wq->wq_queued--;
+		worker_redispatch(wkr, ev);
+	    }
+	}
+    }
+
+    for(i = 0; i < we->we_wq.wq_queued; i++){
+	worker_redispatch(wkr, we->we_heap[i]);
+    }
+    we->we_wq.wq_queued = 0;
+
+    worker_timer_handover(wkr);
+
+    // what producers pushed meanwhile goes after all of the above, they
+    // take back what they push from now on
+    __atomic_store_n(&wkr->wk_handover, kWORKER_HANDOVER_LATE, __ATOMIC_SEQ_CST);
+    worker_reclaim(wkr);
+
+    // nothing left behind, emitters homed here may move now
+    __atomic_add_fetch(&wkr->wk_gen, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&wkr->wk_handover, kWORKER_HANDOVER_DONE, __ATOMIC_SEQ_CST);
+}
+
+static void worker_run(worker_t *wkr){
+    worker_data_t	*wd = get_data();
+    edp_event_t		*evt;
+    int			wait;
+
+    while(worker_running(wkr) && (!wkr->wk_break)){
+	// long events make the event count a poor clock, read the real one
+	// while a timer is armed, and link new ones before they are due
+	if(wkr->wk_timer_next != (uint64_t)-1)
+	    wkr->wk_now = spi_time_now();
+
+	if((--wkr->wk_timer_tick <= 0) || (wkr->wk_now >= wkr->wk_timer_next) ||
+		(!mpscq_empty(&wkr->wk_timer_adds))){
+	    worker_timer_run(wkr);
+
+	    // keep io of the loop thread moving while busy
+	    if(wkr->wk_poll != NULL)
+		wkr->wk_poll(0);
+	}
+
+	evt = worker_next_event(wkr);
+	if(evt == NULL)
+	    evt = worker_steal(wkr);
+
+	if(evt != NULL){
+	    worker_do_event(wkr, evt);
+	    continue;
+	}
+
+	// spinning would only hold io of the loop thread back
+	if((wkr->wk_poll == NULL) && worker_spin(wkr))
+	    continue;
+
+	if(wd->wd_codel_target > 0)
+	    worker_codel_reset(wkr);
+
+	// sleep no longer than the next timer
+	wait = worker_timer_run(wkr);
+
+	// dispatcher checks parker & wd_idle after push, so look again
+	wkr->wk_idle = 1;
+	atomic_inc(&wd->wd_idle);
+	__spi_parker_prepare(&wkr->wk_parker);
+
+	if((wait == 0) || worker_has_event(wkr) || ((evt = worker_steal(wkr)) != NULL) ||
+		(wkr->wk_status != kWORKER_STATUS_RUNNING) || wkr->wk_break){
+	    __spi_parker_cancel(&wkr->wk_parker);
+	}else if(wkr->wk_poll != NULL){
+	    // io callbacks run in here, events they dispatch to us stay local
+	    wkr->wk_sojourn = 0;
+	    wkr->wk_poll(wait);
+	    __spi_parker_cancel(&wkr->wk_parker);
+	}else{
+	    wkr->wk_sojourn = 0;
+	    __spi_parker_park(&wkr->wk_parker, wait);
+	}
+
+	wkr->wk_idle = 0;
+	wkr->wk_timer_tick = 0;
+	atomic_dec(&wd->wd_idle);
+
+	if(evt != NULL)
+	    worker_do_event(wkr, evt);
+    }
+}
+
+// a stopped worker runs what is left, a retired one hands it over
+static void worker_exit(worker_t *wkr){
+    edp_event_t		*evt;
+
+    if(wkr->wk_status == kWORKER_STATUS_RETIRED){
+	worker_handover(wkr);
+    }else{
+	ASSERT(wkr->wk_status == kWORKER_STATUS_STOP);
+
+	// a claim skips events a thief holds the lock of, look again
+	for(;;){
+	    evt = worker_next_event(wkr);
+	    if(evt != NULL){
+		worker_do_event(wkr, evt);
+	    }else if(worker_queues_ready(wkr)){
+		spi_cpu_relax();
+	    }else{
+		break;
+	    }
+	}
+    }
+
+    worker_fini_tls(wkr);
+}
+
+static void *worker_routine(void *data){
+    worker_t		*wkr = (worker_t *)data;
+
+    ASSERT(wkr != NULL);
+
+    worker_init_tls(wkr);
+
+    wkr->wk_status = kWORKER_STATUS_RUNNING;
+
+    __spi_convar_signal(&wkr->wk_convar);
+
+    worker_run(wkr);
+
+    log_warn("worker loop break:%d\n", wkr->wk_status);
+
+    worker_exit(wkr);
+
+    return NULL;
+}
+
+int worker_loop(worker_poll_cb poll, int wakefd){
+    worker_data_t	*wd = get_data();
+    worker_t		*wkr;
+
+    if((!wd->wd_init) || (!wd->wd_loop)){
+	return -EINVAL;
+    }
+
+    wkr = &wd->wd_threads[0];
+    if(!__sync_bool_compare_and_swap(&wd->wd_looping, 0, 1)){
+	return -EBUSY;
+    }
 
-    __spi_convar_t	wk_convar;
+    worker_init_tls(wkr);
+    wkr->wk_poll = poll;
+    __atomic_store_n(&wkr->wk_parker.pk_fd, wakefd, __ATOMIC_SEQ_CST);
 
-    __spi_convar_t	wk_event;
+    worker_run(wkr);
 
-    spi_spinlock_t	wk_crit_lock;
-    struct list_head	wk_crit_events;
-    atomic_t		wk_crit_pending;
-    atomic_t		wk_crit_handled;
+    __atomic_store_n(&wkr->wk_parker.pk_fd, -1, __ATOMIC_SEQ_CST);
+    wkr->wk_poll = NULL;
 
-    spi_spinlock_t	wk_emrg_lock;
-    struct list_head	wk_emrg_events;
-    atomic_t		wk_emrg_pending;
-    atomic_t		wk_emrg_handled;
+    if(wkr->wk_break){
+	// events for worker 0 wait for the next edp_loop or edp_fini
+	wkr->wk_break = 0;
+	__worker_self = NULL;
+    }else{
+	worker_exit(wkr);
+    }
 
-    spi_spinlock_t	wk_high_lock;
-    struct list_head	wk_high_events;
-    atomic_t		wk_high_pending;
-    atomic_t		wk_high_handled;
+    __atomic_store_n(&wd->wd_looping, 0, __ATOMIC_RELEASE);
 
-    spi_spinlock_t	wk_norm_lock;
-    struct list_head	wk_norm_events;
-    atomic_t		wk_norm_pending;
-    atomic_t		wk_norm_handled;
+    return 0;
+}
 
-    spi_spinlock_t	wk_idle_lock;
-    struct list_head	wk_idle_events;
-    atomic_t		wk_idle_pending;
-    atomic_t		wk_idle_handled;
-}worker_t;
+// the loop drains worker 0 when it stops, or this thread does it
+static void worker_stop_caller(worker_t *wkr){
+    worker_data_t	*wd = get_data();
 
-typedef struct worker_data{
-    int			wd_init;
-    int			wd_thread_num;
-    int			wd_round;
-    worker_t		*wd_threads;
-}worker_data_t;
+    __sync_bool_compare_and_swap(&wkr->wk_status,
+	    kWORKER_STATUS_RUNNING, kWORKER_STATUS_STOP);
+    __spi_parker_unpark(&wkr->wk_parker);
 
-static worker_data_t  __worker_data = {};
+    while(!__sync_bool_compare_and_swap(&wd->wd_looping, 0, 1)){
+	spi_thread_yield();
+    }
 
-static inline worker_data_t *get_data(){
-    return &__worker_data;
+    if(wkr->wk_status == kWORKER_STATUS_STOP){
+	worker_init_tls(wkr);
+	worker_exit(wkr);
+    }
 }
 
-static inline void worker_do_event(edp_event_t *ev){
-    ASSERT((ev != NULL) && (ev->ev_handler != NULL));
+int worker_loop_break(){
+    worker_data_t	*wd = get_data();
+    worker_t		*wkr;
 
-    ev->ev_handler(ev->ev_emit, ev);
+    if((!wd->wd_init) || (!wd->wd_loop)){
+	return -EINVAL;
+    }
+
+    wkr = &wd->wd_threads[0];
+    wkr->wk_break = 1;
+    __sync_synchronize();
+    __spi_parker_unpark(&wkr->wk_parker);
+
+    return 0;
 }
 
-static int worker_init_tls(worker_t *wkr){
-    ASSERT(wkr != NULL);
+int __edp_self(void){
+    return (__worker_self != NULL) ? __worker_self->wk_id : -1;
+}
+
+// a retired worker not done with its handover still takes ordered events
+static inline int worker_retiring(int cpuid){
+    worker_data_t	*wd = get_data();
+
+    return (cpuid < wd->wd_thread_max) &&
+	(__atomic_load_n(&wd->wd_threads[cpuid].wk_handover, __ATOMIC_SEQ_CST) !=
+	 kWORKER_HANDOVER_DONE);
+}
 
-    __spi_convar_init(&wkr->wk_event);
+// a shrink moves an emitter's home only after the retired worker handed
+// all its events over, or new ordered events could pass older ones. they
+// went to worker 0 then, the home follows them there unless none of them
+// is left. a slot started again is a new home, its handover count tells.
+uint64_t __edp_home(uint64_t home, int idle){
+    worker_data_t	*wd = get_data();
+    int			cpuid = kEDP_HOME_CPUID(home);
 
-    spi_spin_init(&wkr->wk_crit_lock);
-    INIT_LIST_HEAD(&wkr->wk_crit_events);
+    if(home != kEDP_HOME_NONE){
+	if(__atomic_load_n(&wd->wd_threads[cpuid].wk_gen, __ATOMIC_SEQ_CST) == (home >> 32)){
+	    if((cpuid < wd->wd_thread_num) || worker_retiring(cpuid))
+		return home;
+	}
 
-    spi_spin_init(&wkr->wk_emrg_lock);
-    INIT_LIST_HEAD(&wkr->wk_emrg_events);
+	cpuid = idle ? __edp_select() : 0;
+    }else{
+	cpuid = __edp_select();
+    }
 
-    spi_spin_init(&wkr->wk_high_lock);
-    INIT_LIST_HEAD(&wkr->wk_high_events);
+    return ((uint64_t)__atomic_load_n(&wd->wd_threads[cpuid].wk_gen, __ATOMIC_SEQ_CST) << 32) |
+	(uint32_t)cpuid;
+}
 
-    spi_spin_init(&wkr->wk_norm_lock);
-    INIT_LIST_HEAD(&wkr->wk_norm_events);
+int __edp_select(void){
+    worker_data_t	*wd = get_data();
+    uint32_t		rnd;
+    int			a, b, num = wd->wd_thread_num;
 
-    spi_spin_init(&wkr->wk_idle_lock);
-    INIT_LIST_HEAD(&wkr->wk_idle_events);
+    if((wd->wd_select != kEDP_SELECT_P2C) || (num < 2)){
+	return (int)((uint64_t)atomic_inc(&wd->wd_round) % num);
+    }
+
+    // power of two choices: sample two distinct workers, take the lighter
+    rnd = worker_random();
+    a = rnd % num;
+    b = (a + 1 + (rnd >> 16) % (num - 1)) % num;
+
+    if(worker_load(&wd->wd_threads[b]) < worker_load(&wd->wd_threads[a]))
+	return b;
+
+    return a;
+}
+
+static inline int worker_check_priority(edp_event_t *ev){
+    if((ev->ev_priority < kEDP_EVENT_PRIORITY_IDLE) ||
+	    (ev->ev_priority >= kEDP_EVENT_PRIORITY_MAX)){
+	log_warn("priority out of range!\n");
+	return -ERANGE;
+    }
 
-    wkr->wk_status = kWORKER_STATUS_INIT;
-    
     return 0;
 }
 
-static int worker_fini_tls(worker_t *wkr){
-    ASSERT(wkr!= NULL);
+// pick target worker and the queue to push the event on
+static mpscq_t *worker_route(edp_event_t *ev, worker_t **wkr, worker_queue_t **wq){
+    worker_data_t	*wd = get_data();
+    int			cpuid;
 
-    if(wkr->wk_status != kWORKER_STATUS_STOP){
-	return -1;
+    if((ev->ev_cpuid >= 0) && (ev->ev_cpuid < wd->wd_thread_num)){
+	cpuid = ev->ev_cpuid;
+    }else if((ev->ev_flags & kEDP_EVENT_FLAG_ORDERED) && (ev->ev_cpuid >= 0)){
+	// a retiring home hands this over behind the older ones, a retired
+	// one handed them to worker 0
+	if(!worker_retiring(ev->ev_cpuid))
+	    ev->ev_cpuid = 0;
+	cpuid = ev->ev_cpuid;
+    }else if((ev->ev_flags & kEDP_EVENT_FLAG_LOCAL) && (__worker_self != NULL) &&
+	    (__worker_self->wk_id < wd->wd_thread_num)){
+	cpuid = __worker_self->wk_id;
+	ev->ev_cpuid = cpuid;
+    }else{
+	cpuid = __edp_select();
+	ev->ev_cpuid = cpuid;
+    }
+
+    *wkr = &(wd->wd_threads[cpuid]);
+
+    if((ev->ev_deadline != 0) && (ev->ev_priority <= kEDP_EVENT_PRIORITY_HIGH)){
+	*wq = &((*wkr)->wk_edf.we_wq);
+	return &(*wq)->wq_queue;
+    }
+
+    *wq	 = &((*wkr)->wk_queues[ev->ev_priority]);
+
+    return worker_stealable(ev) ? &(*wq)->wq_shared : &(*wq)->wq_queue;
+}
+
+// wake target, and an idle sibling if target has a backlog to steal
+static inline void worker_notify(worker_t *wkr, worker_queue_t *wq, mpscq_t *mq){
+    worker_data_t	*wd = get_data();
+
+    __spi_parker_unpark(&wkr->wk_parker);
+
+    if((mq == &wq->wq_shared) && (wd->wd_idle > 0) && (wq->wq_pending > 1)){
+	worker_wake_idle(wkr);
+    }
+}
+
+// a handler dispatches to its own worker: no wakeup of itself, and no
+// atomics for events thieves can't take anyway
+static void worker_dispatch_local(worker_t *wkr, worker_queue_t *wq, mpscq_t *mq,
+	edp_event_t *ev){
+    worker_data_t   *wd = get_data();
+    int		    num;
+
+    // stealable ones stay where idle siblings look for them
+    if(mq == &wq->wq_shared){
+	atomic_inc(&wq->wq_pending);
+	mpscq_push(mq, &ev->ev_qnode);
+
+	if((wd->wd_idle > 0) && (wq->wq_pending > 1))
+	    worker_wake_idle(wkr);
+	return ;
+    }
+
+    if(wq == &wkr->wk_edf.we_wq){
+	if(worker_edf_insert(&wkr->wk_edf, ev) == 0)
+	    return ;
+
+	wq = &wkr->wk_queues[kEDP_EVENT_PRIORITY_HIGH];
+    }
+
+    // behind what others pushed before
+    if(!mpscq_empty(&wq->wq_queue)){
+	num = worker_queue_append(wq, mpscq_grab(&wq->wq_queue));
+	atomic_sub(&wq->wq_pending, num);
+    }
+
+    list_add_tail(&ev->ev_node, &wq->wq_events);
+    wq->wq_queued++;
+}
+
+// admit is 0 for events already accepted once, they are never rejected
+static int worker_dispatch(edp_event_t *ev, int admit){
+    worker_t		*wkr;
+    worker_queue_t	*wq;
+    mpscq_t		*mq;
+    int			ret, cpuid;
+
+    ASSERT(ev != NULL);
+
+    ret = worker_check_priority(ev);
+    if(ret != 0){
+	return ret;
     }
 
-    spi_spin_fini(&wkr->wk_idle_lock);
+    if(get_data()->wd_stamp)
+	ev->ev_stamp = spi_time_now();
 
-    spi_spin_fini(&wkr->wk_norm_lock);
+    cpuid = ev->ev_cpuid;
+    mq = worker_route(ev, &wkr, &wq);
 
-    spi_spin_fini(&wkr->wk_high_lock);
+    // the queue sheds already, fail fast
+    if(admit && wq->wq_overload && worker_sheddable(ev, ev->ev_priority)){
+	ev->ev_cpuid = cpuid;
+	return -kEDP_ERR_OVERLOAD;
+    }
 
-    spi_spin_fini(&wkr->wk_emrg_lock);
+    if(wkr == __worker_self){
+	worker_dispatch_local(wkr, wq, mq, ev);
+	return 0;
+    }
 
-    spi_spin_fini(&wkr->wk_crit_lock);
+    // count it before it is visible to the owner
+    atomic_inc(&wq->wq_pending);
+    mpscq_push(mq, &ev->ev_qnode);
 
-    __spi_convar_fini(&wkr->wk_event);
+    worker_notify(wkr, wq, mq);
 
-    wkr->wk_status = kWORKER_STATUS_ZERO;
+    worker_check_retired(wkr);
 
     return 0;
 }
 
-static void *worker_routine(void *data){
-    worker_t		*wkr = (worker_t *)data;
-    edp_event_t		*evt;
-    struct list_head	events;
-    struct list_head	*pos, *tmp;
-    int			ratio = 0, high = 0;
+int __edp_dispatch(edp_event_t *ev){
+    return worker_dispatch(ev, 1);
+}
 
-    ASSERT(wkr != NULL);
+void __edp_stamp(edp_event_t *ev){
+    ev->ev_stamp = get_data()->wd_stamp ? spi_time_now() : 0;
+}
 
-    INIT_LIST_HEAD(&events);
-    worker_init_tls(wkr);
+int __edp_admit(edp_event_t *ev, int cpuid, int priority){
+    worker_data_t	*wd = get_data();
 
-    wkr->wk_status = kWORKER_STATUS_RUNNING;
+    if((cpuid < 0) || (cpuid >= wd->wd_thread_num) || (priority < 0) ||
+	    (priority >= kEDP_EVENT_PRIORITY_MAX)){
+	return 0;
+    }
 
-    __spi_convar_signal(&wkr->wk_convar);
+    if(wd->wd_threads[cpuid].wk_queues[priority].wq_overload &&
+	    worker_sheddable(ev, priority)){
+	return -kEDP_ERR_OVERLOAD;
+    }
+
+    return 0;
+}
 
-    while(wkr->wk_status != kWORKER_STATUS_STOP){
-	__spi_convar_wait(&wkr->wk_event);
+int __edp_shed(edp_event_t *ev, int priority){
+    worker_data_t	*wd = get_data();
+    worker_t		*wkr = __worker_self;
+    uint64_t		now;
 
-criti_event:
-	spi_spin_lock(&wkr->wk_crit_lock);
-	if(!list_empty(&wkr->wk_crit_events)){
-	    list_splice_init(&wkr->wk_crit_events, &events);
-	}
-	atomic_reset(&wkr->wk_crit_pending);
-	spi_spin_unlock(&wkr->wk_crit_lock);
+    if((wkr == NULL) || (wd->wd_codel_target == 0) || (ev->ev_stamp == 0) ||
+	    (!worker_sheddable(ev, priority))){
+	return 0;
+    }
+
+    now = spi_time_now();
+
+    return worker_codel(&wkr->wk_queues[priority], now > ev->ev_stamp ? now - ev->ev_stamp : 0, now);
+}
+
+// events of one batch bound for the same queue
+typedef struct worker_batch{
+    worker_t		*wb_worker;
+    worker_queue_t	*wb_wq;
+    mpscq_t		*wb_queue;
+    mpscq_node_t	*wb_first;  // oldest
+    mpscq_node_t	*wb_last;   // newest, chain links back to first
+    int			wb_num;
+}worker_batch_t;
+
+static void worker_batch_flush(worker_batch_t *wbs, int num){
+    worker_batch_t	*wb;
+    int			i, j;
+
+    for(i = 0; i < num; i++){
+	wb = &wbs[i];
+	atomic_add(&wb->wb_wq->wq_pending, wb->wb_num);
+	mpscq_push_chain(wb->wb_queue, wb->wb_first, wb->wb_last);
+    }
 
-	list_for_each_safe(pos, tmp, &events){
-	    evt = list_entry(pos, struct edp_event, ev_node);
-	    if(evt->ev_type != kEDP_EVENT_PRIORITY_CRIT)
+    // every worker once
+    for(i = 0; i < num; i++){
+	for(j = 0; j < i; j++){
+	    if(wbs[j].wb_worker == wbs[i].wb_worker)
 		break;
-	    list_del(pos);
-	    worker_do_event(evt);
-	    atomic_inc(&wkr->wk_crit_handled);
 	}
 
-emerg_event:
-	spi_spin_lock(&wkr->wk_emrg_lock);
-	if(!list_empty(&wkr->wk_emrg_events)){
-	    list_splice_init(&wkr->wk_emrg_events, &events);
-	}
-	atomic_reset(&wkr->wk_emrg_pending);
-	spi_spin_unlock(&wkr->wk_emrg_lock);
+	if(j == i)
+	    worker_notify(wbs[i].wb_worker, wbs[i].wb_wq, wbs[i].wb_queue);
 
-	list_for_each_safe(pos, tmp, &events){
-	    evt = list_entry(pos, struct edp_event, ev_node);
-	    if(evt->ev_type != kEDP_EVENT_PRIORITY_EMRG)
-		break;
-	    list_del(pos);
-	    worker_do_event(evt);
-	    atomic_inc(&wkr->wk_emrg_handled);
+	worker_check_retired(wbs[i].wb_worker);
+    }
+}
 
-	    if(wkr->wk_crit_pending)
-		goto criti_event;
-	}
-	
-high_event:
-	spi_spin_lock(&wkr->wk_high_lock);
-	if(!list_empty(&wkr->wk_high_events)){
-	    list_splice_init(&wkr->wk_high_events, &events);
+int __edp_dispatch_batch(edp_event_t **evs, int num){
+    worker_batch_t	wbs[BATCH_GROUP_MAX];
+    worker_batch_t	*wb;
+    worker_t		*wkr;
+    worker_queue_t	*wq;
+    mpscq_t		*mq;
+    uint64_t		now = 0;
+    int			i, j, groups = 0;
+
+    ASSERT((evs != NULL) || (num == 0));
+
+    // all or nothing
+    for(i = 0; i < num; i++){
+	if(worker_check_priority(evs[i]) != 0)
+	    return -ERANGE;
+    }
+
+    if(get_data()->wd_stamp)
+	now = spi_time_now();
+
+    for(i = 0; i < num; i++){
+	evs[i]->ev_stamp = now;
+	mq = worker_route(evs[i], &wkr, &wq);
+
+	// a batch can't hand rejected ones back, they complete as shed
+	if(wq->wq_overload && worker_sheddable(evs[i], evs[i]->ev_priority)){
+	    worker_shed(evs[i]);
+	    continue;
 	}
-	ratio = atomic_reset(&wkr->wk_high_pending);
-	spi_spin_unlock(&wkr->wk_high_lock);
 
-	// tell norm part: ratio is useful
-	high = (ratio != 0) ? 1 : 0;
+	if(wkr == __worker_self){
+	    worker_dispatch_local(wkr, wq, mq, evs[i]);
+	    continue;
+	}
 
-	list_for_each_safe(pos, tmp, &events){
-	    evt = list_entry(pos, struct edp_event, ev_node);
-	    if(evt->ev_type != kEDP_EVENT_PRIORITY_HIGH)
+	for(j = 0; j < groups; j++){
+	    if(wbs[j].wb_queue == mq)
 		break;
-	    list_del(pos);
-	    worker_do_event(evt);
-	    atomic_inc(&wkr->wk_high_handled);
-
-	    if(wkr->wk_crit_pending)
-		goto criti_event;
-	    if(wkr->wk_emrg_pending)
-		goto emerg_event;
-	}
-	
-norm_event:
-	spi_spin_lock(&wkr->wk_norm_lock);
-	if(!list_empty(&wkr->wk_norm_events)){
-	    list_splice_tail_init(&wkr->wk_norm_events, &events);
-	}
-	atomic_reset(&wkr->wk_norm_pending);
-	spi_spin_unlock(&wkr->wk_norm_lock);
-
-	ratio /= HIGH_NORM_RATIO;
-	list_for_each_safe(pos, tmp, &events){
-	    evt = list_entry(pos, struct edp_event, ev_node);
-	    list_del(pos);
-	    worker_do_event(evt);
-	    atomic_inc(&wkr->wk_norm_handled);
-
-	    if(wkr->wk_crit_pending)
-		goto criti_event;
-	    if(wkr->wk_emrg_pending)
-		goto emerg_event;
-
-	    if(wkr->wk_high_pending){
-		if(high == 0){
-		    goto high_event;
-		}else if(ratio == 0){
-		    goto high_event;
-		}
-	    }
-	    ratio--;
 	}
-	
-idle_event:
-	spi_spin_lock(&wkr->wk_idle_lock);
-	if(!list_empty(&wkr->wk_idle_events)){
-	    list_splice_tail_init(&wkr->wk_idle_events, &events);
+
+	if(j == groups){
+	    if(groups == BATCH_GROUP_MAX){
+		worker_batch_flush(wbs, groups);
+		j = groups = 0;
+	    }
+
+	    wb = &wbs[groups++];
+	    wb->wb_worker = wkr;
+	    wb->wb_wq	  = wq;
+	    wb->wb_queue  = mq;
+	    wb->wb_first  = &evs[i]->ev_qnode;
+	    wb->wb_last	  = NULL;
+	    wb->wb_num	  = 0;
 	}
-	atomic_reset(&wkr->wk_idle_pending);
-	spi_spin_unlock(&wkr->wk_idle_lock);
 
-	list_for_each_safe(pos, tmp, &events){
-	    evt = list_entry(pos, struct edp_event, ev_node);
-	    list_del(pos);
-	    worker_do_event(evt);
-	    atomic_inc(&wkr->wk_idle_handled);
+	wb = &wbs[j];
+	evs[i]->ev_qnode.next = wb->wb_last;
+	wb->wb_last = &evs[i]->ev_qnode;
+	wb->wb_num++;
+    }
+
+    worker_batch_flush(wbs, groups);
+
+    return 0;
+}
+
+uint64_t edp_deadline_missed(){
+    worker_data_t   *wd = get_data();
+    uint64_t	    missed = 0;
+    int		    i;
+
+    for(i = 0; i < wd->wd_thread_max; i++){
+	missed += wd->wd_threads[i].wk_edf.we_missed;
+    }
+
+    return missed;
+}
+
+int edp_stats(int worker, edp_stats_t *stats){
+    worker_data_t   *wd = get_data();
+    worker_t	    *wkr;
+    worker_queue_t  *wq;
+    int		    i, prio;
+
+    if((stats == NULL) || (worker >= wd->wd_thread_max)){
+	return -EINVAL;
+    }
 
-	    if(wkr->wk_crit_pending)
-		goto criti_event;
-	    if(wkr->wk_emrg_pending)
-		goto emerg_event;
-	    if(wkr->wk_high_pending)
-		goto high_event;
-	    if(wkr->wk_norm_pending)
-		goto norm_event;
+    // retired workers keep their counters
+    memset(stats, 0, sizeof(*stats));
+    for(i = 0; i < wd->wd_thread_max; i++){
+	if((worker >= 0) && (worker != i))
+	    continue;
+
+	wkr = &wd->wd_threads[i];
+	for(prio = 0; prio < kEDP_EVENT_PRIORITY_MAX; prio++){
+	    wq = &wkr->wk_queues[prio];
+	    stats->es_handled[prio] += wq->wq_handled;
+	    stats->es_pending[prio] += wq->wq_pending + wq->wq_queued;
 	}
+	stats->es_deadline_handled += wkr->wk_edf.we_wq.wq_handled;
+	stats->es_deadline_missed += wkr->wk_edf.we_missed;
+	stats->es_stolen += wkr->wk_stolen;
+	stats->es_promoted += wkr->wk_promoted;
+	stats->es_shed += wkr->wk_queues[kEDP_EVENT_PRIORITY_NORM].wq_shed +
+	    wkr->wk_queues[kEDP_EVENT_PRIORITY_IDLE].wq_shed;
     }
 
-    log_warn("worker loop break:%d\n", wkr->wk_status);
+    return 0;
+}
+
+// create the thread of a worker slot, wait until it runs
+static int worker_start(worker_t *wkr){
+    int		    ret;
 
-    ASSERT(wkr->wk_status == kWORKER_STATUS_STOP);
+    // the edp_loop caller will run it, its events queue up till then
+    if(wkr->wk_caller){
+	wkr->wk_status = kWORKER_STATUS_RUNNING;
+	return 0;
+    }
 
-    if(wkr->wk_crit_pending)
-	goto criti_event;
-    if(wkr->wk_emrg_pending)
-	goto emerg_event;
-    if(wkr->wk_high_pending)
-	goto high_event;
-    if(wkr->wk_norm_pending)
-	goto norm_event;
-    if(wkr->wk_idle_pending)
-	goto idle_event;
+    wkr->wk_status = kWORKER_STATUS_INIT;
+    wkr->wk_handover = kWORKER_HANDOVER_NONE;
 
-    worker_fini_tls(wkr);
+    ret = __spi_convar_init(&wkr->wk_convar);
+    if(ret != 0){
+	log_warn("initialize convar fail:%d\n", ret);
+	return ret;
+    }
 
-    return NULL;
+    ret = spi_thread_create_on(&wkr->wk_thread, worker_routine, wkr,
+	    __edp_thread_cpu(kEDP_THREAD_WORKER, wkr->wk_id));
+    if(ret != 0){
+	log_warn("create work thread fail:%d\n", ret);
+	__spi_convar_fini(&wkr->wk_convar);
+	return ret;
+    }
+
+    ret = __spi_convar_timedwait(&wkr->wk_convar, 1000);
+    if(ret != 0){
+	log_warn("work thread not run:%d - %d\n", ret, ETIMEDOUT);
+	spi_thread_destroy(wkr->wk_thread);
+	__spi_convar_fini(&wkr->wk_convar);
+	return ret;
+    }
+
+    wkr->wk_started = 1;
+
+    return 0;
 }
 
-int __edp_dispatch(edp_event_t *ev){
-    worker_data_t	*wd = get_data();
-    worker_t		*wkr;
-    spi_spinlock_t	*lock;
-    struct list_head	*lh;
-    atomic_t		*pendings;
-    int			cpuid;
+static void worker_join(worker_t *wkr){
+    if(!wkr->wk_started)
+	return ;
 
-    ASSERT(ev != NULL);
+    spi_thread_join(wkr->wk_thread);
+    __spi_convar_fini(&wkr->wk_convar);
+    wkr->wk_started = 0;
+}
 
-    // FIXME:should base on cpu load
-    if((ev->ev_cpuid >= 0) && (ev->ev_cpuid < wd->wd_round)){
-	cpuid = ev->ev_cpuid;
-    }else{
-	cpuid = wd->wd_round;
-	ev->ev_cpuid = cpuid;
-	wd->wd_round++;
-	wd->wd_round = wd->wd_round % wd->wd_thread_num;
+int edp_workers(){
+    return get_data()->wd_thread_num;
+}
+
+int edp_workers_resize(int num){
+    worker_data_t   *wd = get_data();
+    worker_t	    *wkr;
+    int		    i, old, ret = 0;
+
+    if(!wd->wd_init){
+	return -EINVAL;
     }
 
-    wkr = &(wd->wd_threads[cpuid]);
-    switch(ev->ev_priority){
-	case kEDP_EVENT_PRIORITY_CRIT:
-	    lock = &wkr->wk_crit_lock;
-	    lh   = &wkr->wk_crit_events;
-	    pendings = &wkr->wk_crit_pending;
-	    break;
+    if((num < 1) || (num > wd->wd_thread_max)){
+	return -ERANGE;
+    }
 
-	case kEDP_EVENT_PRIORITY_EMRG:
-	    lock = &wkr->wk_emrg_lock;
-	    lh   = &wkr->wk_emrg_events;
-	    pendings = &wkr->wk_emrg_pending;
-	    break;
+    spi_mutex_lock(&wd->wd_lock);
 
-	case kEDP_EVENT_PRIORITY_HIGH:
-	    lock = &wkr->wk_high_lock;
-	    lh   = &wkr->wk_high_events;
-	    pendings = &wkr->wk_high_pending;
-	    break;
+    old = wd->wd_thread_num;
+    for(i = old; i < num; i++){
+	wkr = &wd->wd_threads[i];
+
+	// not gone yet, let it stay
+	if(__sync_bool_compare_and_swap(&wkr->wk_status,
+		    kWORKER_STATUS_RETIRE, kWORKER_STATUS_RUNNING)){
+	    continue;
+	}
 
-	case kEDP_EVENT_PRIORITY_NORM:
-	    lock = &wkr->wk_norm_lock;
-	    lh   = &wkr->wk_norm_events;
-	    pendings = &wkr->wk_norm_pending;
+	worker_join(wkr);
+	ret = worker_start(wkr);
+	if(ret != 0)
 	    break;
+    }
+
+    // select new workers only after they run
+    if(i > old){
+	wd->wd_thread_num = i;
+    }
+
+    if(num < old){
+	wd->wd_thread_num = num;
+	__sync_synchronize();
+
+	for(i = num; i < old; i++){
+	    wkr = &wd->wd_threads[i];
+	    __sync_bool_compare_and_swap(&wkr->wk_status,
+		    kWORKER_STATUS_RUNNING, kWORKER_STATUS_RETIRE);
+	    __spi_parker_unpark(&wkr->wk_parker);
+	}
+    }
+
+    spi_mutex_unlock(&wd->wd_lock);
+
+    return ret;
+}
 
-	case kEDP_EVENT_PRIORITY_IDLE:
-	    lock = &wkr->wk_idle_lock;
-	    lh   = &wkr->wk_idle_events;
-	    pendings = &wkr->wk_idle_pending;
+// add a worker when events wait too long, retire one after all the
+// workers have had idle ones for a while
+static void *worker_scaler(void *data){
+    worker_data_t   *wd = (worker_data_t *)data;
+    uint64_t	    sojourn, now, idle_since = 0;
+    int		    i, num;
+
+    while(wd->wd_scaling){
+	// a spurious wakeup just looks early
+	__spi_convar_timedwait(&wd->wd_scaler_cv, wd->wd_scale_ms);
+	if(!wd->wd_scaling)
 	    break;
 
-	default:
-	    log_warn("priority out of range!\n");
-	    return -ERANGE;
+	num = wd->wd_thread_num;
+	for(i = 0, sojourn = 0; i < num; i++){
+	    if(wd->wd_threads[i].wk_sojourn > sojourn)
+		sojourn = wd->wd_threads[i].wk_sojourn;
+	}
+
+	if((sojourn > wd->wd_sojourn) && (num < wd->wd_thread_max)){
+	    edp_workers_resize(num + 1);
+	    idle_since = 0;
+	    continue;
+	}
+
+	if((wd->wd_idle == 0) || (num <= wd->wd_thread_min) ||
+		(sojourn > wd->wd_sojourn / 4)){
+	    idle_since = 0;
+	    continue;
+	}
+
+	now = spi_time_now();
+	if(idle_since == 0){
+	    idle_since = now;
+	}else if(now - idle_since >= wd->wd_idle_ns){
+	    edp_workers_resize(num - 1);
+	    idle_since = 0;
+	}
+    }
+
+    return NULL;
+}
+
+int edp_latency(int worker, int priority, int kind, histo_t *histo, int reset){
+    worker_data_t   *wd = get_data();
+    worker_t	    *wkr;
+    int		    i, prio;
+
+    if((histo == NULL) || (worker >= wd->wd_thread_max) ||
+	    (priority >= kEDP_EVENT_PRIORITY_MAX) ||
+	    ((kind != kEDP_LATENCY_WAIT) && (kind != kEDP_LATENCY_RUN))){
+	return -EINVAL;
     }
 
-    spi_spin_lock(lock);
-    list_add_tail(&ev->ev_node, lh);
-    atomic_inc(pendings);
-    spi_spin_unlock(lock);
+    for(i = 0; i < wd->wd_thread_max; i++){
+	if((worker >= 0) && (worker != i))
+	    continue;
 
-    __spi_convar_signal(&wkr->wk_event);
+	wkr = &wd->wd_threads[i];
+	for(prio = 0; prio < kEDP_EVENT_PRIORITY_MAX; prio++){
+	    if((priority >= 0) && (priority != prio))
+		continue;
+
+	    histo_take(histo, (kind == kEDP_LATENCY_WAIT) ?
+		    &wkr->wk_wait[prio] : &wkr->wk_run[prio], reset);
+	}
+    }
 
     return 0;
 }
 
-int worker_init(int thread){
+int worker_init(edp_conf_t *conf){
     worker_data_t   *wd = get_data();
     worker_t	    *wkr;
-    int		    i, ret = -1;
+    int		    thread = conf->ec_workers;
+    int		    slots, i, ret = -1;
 
     if(wd->wd_init){
 	return -1;
     }
 
-    wd->wd_threads = (worker_t *)mheap_alloc(sizeof(*wkr) * thread);
+    if(thread <= 0){
+	return -EINVAL;
+    }
+
+    slots = conf->ec_worker_max > thread ? conf->ec_worker_max : thread;
+    wd->wd_threads = (worker_t *)mheap_alloc_aligned(sizeof(*wkr) * slots, kSPI_CACHELINE);
     if(wd->wd_threads == NULL){
 	return -ENOMEM;
     }
-    memset(wd->wd_threads, 0, sizeof(*wkr) * thread);
+    memset(wd->wd_threads, 0, sizeof(*wkr) * slots);
 
-    for(i = 0; i < thread; i++){
-	wkr = &(wd->wd_threads[i]);
-	ret = __spi_convar_init(&wkr->wk_convar);
-	if(ret != 0){
-	    log_warn("initialize convar fail:%d\n", ret);
-	    break;
-	}
+    for(i = 0; i < slots; i++){
+	worker_init_slot(&wd->wd_threads[i], i);
+    }
 
-        ret = spi_thread_create(&wkr->wk_thread, worker_routine, wkr);
-	if(ret != 0){
-	    log_warn("create work thread fail:%d\n", ret);
-	    __spi_convar_fini(&wkr->wk_convar);
-	    break;
-	}
+    wd->wd_thread_num = thread;
+    wd->wd_thread_max = slots;
+    wd->wd_thread_min = conf->ec_worker_min;
+    if((wd->wd_thread_min <= 0) || (wd->wd_thread_min > thread))
+	wd->wd_thread_min = thread;
 
-	ret = __spi_convar_timedwait(&wkr->wk_convar, 1000);
-	if(ret != 0){
-	    log_warn("work thread not run:%d - %d\n", ret, ETIMEDOUT);
-	    spi_thread_destroy(wkr->wk_thread);
-	    __spi_convar_fini(&wkr->wk_convar);
+    wd->wd_select = conf->ec_select;
+    wd->wd_spin = (uint64_t)conf->ec_spin_us * 1000;
+    for(i = 0; i < kEDP_EVENT_PRIORITY_MAX; i++){
+	wd->wd_weights[i] = conf->ec_weights[i] > 0 ? conf->ec_weights[i] : 0;
+    }
+
+    wd->wd_scale_ms = conf->ec_scale_ms;
+    wd->wd_latency = conf->ec_latency;
+    wd->wd_codel_target = (uint64_t)(conf->ec_codel_us > 0 ? conf->ec_codel_us : 0) * 1000;
+    wd->wd_codel_interval = (uint64_t)(conf->ec_codel_ms > 0 ? conf->ec_codel_ms : 100) * 1000000;
+    wd->wd_aging = (uint64_t)(conf->ec_aging_ms > 0 ? conf->ec_aging_ms : 0) * 1000000;
+    wd->wd_stamp = (wd->wd_scale_ms > 0) || wd->wd_latency ||
+	(wd->wd_codel_target > 0) || (wd->wd_aging > 0);
+    wd->wd_sojourn = (uint64_t)conf->ec_sojourn_us * 1000;
+    wd->wd_idle_ns = (uint64_t)conf->ec_idle_ms * 1000000;
+    spi_mutex_init(&wd->wd_lock);
+
+    wd->wd_loop = (conf->ec_loop & kEDP_LOOP_WORKER) ? 1 : 0;
+    wd->wd_looping = 0;
+    wd->wd_threads[0].wk_caller = wd->wd_loop;
+
+    for(i = 0; i < thread; i++){
+	ret = worker_start(&wd->wd_threads[i]);
+	if(ret != 0)
 	    break;
-	}
     }
 
     if(i != thread){
-	for(; i>= 0; i--){
+	for(i--; i >= 0; i--){
 	    wkr = &(wd->wd_threads[i]);
+	    if(wkr->wk_caller)
+		continue;
 	    spi_thread_destroy(wkr->wk_thread);
 	    __spi_convar_fini(&wkr->wk_convar);
 	}
+	for(i = 0; i < slots; i++){
+	    worker_fini_slot(&wd->wd_threads[i]);
+	}
+	spi_mutex_fini(&wd->wd_lock);
 	mheap_free(wd->wd_threads);
-    }else{
-	wd->wd_init = 1;
-	wd->wd_thread_num = thread;
+	return ret;
+    }
+
+    wd->wd_init = 1;
+
+    if(wd->wd_scale_ms > 0){
+	__spi_convar_init(&wd->wd_scaler_cv);
+	wd->wd_scaling = 1;
+	ret = spi_thread_create(&wd->wd_scaler, worker_scaler, wd);
+	if(ret != 0){
+	    log_warn("create autoscaler fail:%d\n", ret);
+	    wd->wd_scaling = 0;
+	    __spi_convar_fini(&wd->wd_scaler_cv);
+	    ret = 0;
+	}
     }
 
     return ret;
@@ -403,20 +1987,50 @@ int worker_fini(){
     worker_t	    *wkr;
     int		    i;
 
-    if(wd->wd_init){
-	wd->wd_init = 0;
-	for(i = wd->wd_thread_num; i >= 0; i--){
-	    wkr = &(wd->wd_threads[i]);
-	    __spi_convar_fini(&wkr->wk_convar);
+    if(!wd->wd_init){
+	return 0;
+    }
+
+    if(wd->wd_scaling){
+	wd->wd_scaling = 0;
+	__spi_convar_signal(&wd->wd_scaler_cv);
+	spi_thread_join(wd->wd_scaler);
+	__spi_convar_fini(&wd->wd_scaler_cv);
+    }
+
+    // first, so what it leaves can still go to the others
+    if(wd->wd_loop){
+	worker_stop_caller(&wd->wd_threads[0]);
+    }
 
-	    wkr->wk_status = kWORKER_STATUS_STOP; // let it stop
-//	    spi_thread_destroy(&wkr->wk_thread);
-	    //FIXME:join it
+    spi_mutex_lock(&wd->wd_lock);
+    wd->wd_init = 0;
+
+    for(i = 0; i < wd->wd_thread_max; i++){
+	wkr = &(wd->wd_threads[i]);
+	if(!wkr->wk_started)
+	    continue;
+
+	// retired ones are on their way out
+	if(!__sync_bool_compare_and_swap(&wkr->wk_status,
+		    kWORKER_STATUS_RUNNING, kWORKER_STATUS_STOP)){
+	    __sync_bool_compare_and_swap(&wkr->wk_status,
+		    kWORKER_STATUS_RETIRE, kWORKER_STATUS_STOP);
 	}
-	mheap_free(wd->wd_threads);
+	__spi_parker_unpark(&wkr->wk_parker);
     }
 
-    return 0;
-}
+    for(i = 0; i < wd->wd_thread_max; i++){
+	worker_join(&wd->wd_threads[i]);
+	worker_fini_slot(&wd->wd_threads[i]);
+    }
+    spi_mutex_unlock(&wd->wd_lock);
 
+    spi_mutex_fini(&wd->wd_lock);
+    mheap_free(wd->wd_threads);
+    wd->wd_threads = NULL;
+    wd->wd_thread_num = 0;
+    wd->wd_thread_max = 0;
 
+    return 0;
+}
@@ -10,9 +10,19 @@
 extern "C" {
 #endif
 
-int worker_init(int thread_num);
+struct edp_conf;
+
+int worker_init(struct edp_conf *conf);
 int worker_fini();
 
+// waits up to ms (< 0 for ever) for io and handles it
+typedef int (*worker_poll_cb)(int ms);
+
+// run worker 0 on the calling thread until worker_loop_break. poll, if
+// any, replaces sleeping when idle and wakefd interrupts it.
+int worker_loop(worker_poll_cb poll, int wakefd);
+int worker_loop_break();
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,126 @@
+
+#include "edp.h"
+#include "emitter.h"
+
+#include "logger.h"
+#include "mcache.h"
+
+#include <stdio.h>
+
+/*
+ * dispatch benchmark: producers keep every worker busy through emitters,
+ * so events cross from producer threads to the owning workers. bench is
+ * built with the cache line split worker layout, bench-packed with
+ * worker.c built -DWORKER_PACKED, `make bench-compare` runs both.
+ */
+
+#define BENCH_EVENTS		    (1000 * 1000)
+#define BENCH_PRODUCER_MAX	    64
+#define BENCH_ROUNDS		    5
+
+#ifdef WORKER_PACKED
+#define BENCH_LAYOUT		    "packed"
+#else
+#define BENCH_LAYOUT		    "cacheline"
+#endif
+
+struct bench_producer{
+    spi_thread_t	bp_thread;
+    emit_t		bp_emit;
+    edp_event_t		*bp_events;
+    int			bp_num;
+};
+
+static atomic_t		    __bench_done;
+
+static int bench_handler(emit_t em, edp_event_t *ev){
+    return 0;
+}
+
+static void bench_done(edp_event_t *ev, void *data, int errcode){
+    atomic_inc(&__bench_done);
+}
+
+static void *bench_producer_routine(void *data){
+    struct bench_producer   *bp = (struct bench_producer *)data;
+    int			    i;
+
+    for(i = 0; i < bp->bp_num; i++){
+	edp_event_init(&bp->bp_events[i], 0, kEDP_EVENT_PRIORITY_NORM);
+	emit_dispatch(bp->bp_emit, &bp->bp_events[i], bench_done, NULL);
+    }
+
+    return NULL;
+}
+
+// ns per event from first dispatch to last completion
+static double bench_dispatch(int producers){
+    struct bench_producer   bp[BENCH_PRODUCER_MAX];
+    uint64_t		    start;
+    int			    i, num = BENCH_EVENTS / producers;
+
+    atomic_reset(&__bench_done);
+
+    for(i = 0; i < producers; i++){
+	bp[i].bp_num = num;
+	bp[i].bp_events = mheap_alloc(sizeof(edp_event_t) * num);
+	emit_create(NULL, &bp[i].bp_emit);
+	emit_add_handler(bp[i].bp_emit, 0, bench_handler);
+    }
+
+    start = spi_time_now();
+    for(i = 0; i < producers; i++){
+	spi_thread_create(&bp[i].bp_thread, bench_producer_routine, &bp[i]);
+    }
+
+    for(i = 0; i < producers; i++){
+	spi_thread_join(bp[i].bp_thread);
+    }
+
+    while(__bench_done < num * producers){
+	spi_thread_yield();
+    }
+    start = spi_time_now() - start;
+
+    for(i = 0; i < producers; i++){
+	emit_destroy(bp[i].bp_emit);
+	mheap_free(bp[i].bp_events);
+    }
+
+    return (double)start / (num * producers);
+}
+
+int main(int argc, char *argv[]){
+    edp_conf_t	    conf;
+    double	    ns, best = 0;
+    int		    workers, producers, i;
+
+    workers = (argc > 1) ? atoi(argv[1]) : 2;
+    producers = (argc > 2) ? atoi(argv[2]) : 2;
+    if((workers <= 0) || (producers <= 0) || (producers > BENCH_PRODUCER_MAX)){
+	printf("usage: %s [workers] [producers <= %d]\n", argv[0], BENCH_PRODUCER_MAX);
+	return -1;
+    }
+
+    edp_conf_init(&conf, workers);
+    conf.ec_latency = 0;
+    if(edp_init_conf(&conf) != 0){
+	printf("edp init fail\n");
+	return -1;
+    }
+
+    // the best round, the others lost time to something else
+    for(i = 0; i < BENCH_ROUNDS; i++){
+	ns = bench_dispatch(producers);
+	if((i == 0) || (ns < best))
+	    best = ns;
+    }
+
+    printf("dispatch, %s layout, %d workers %d producers : %6.2f ns/event\n",
+	    BENCH_LAYOUT, workers, producers, best);
+
+    edp_fini();
+
+    return 0;
+}
+
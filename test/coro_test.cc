@@ -0,0 +1,335 @@
+
+#include "coro.hpp"
+
+#include "logger.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/*
+ * coroutine tests: the emitter dispatch awaiter gives the handler's
+ * result, then socket write & read awaiters echo through a plain echo
+ * server thread until it hangs up. both coroutines start on a worker,
+ * from a handler. returns 0 if all of them pass.
+ */
+
+#define CORO_WAIT_MS		    5000
+#define CORO_DISPATCH_NUM	    1000
+#define CORO_ECHO_NUM		    1000
+#define CORO_ECHO_MAX		    64
+
+#define CORO_CHECK(cond)   do{						\
+	if(!(cond)){							\
+	    printf("%s:%d check fail: %s\n", __FILE__, __LINE__, #cond);	\
+	    return -1;							\
+	}								\
+    }while(0)
+
+// a coroutine can't return -1, it counts failed checks & says it is done
+#define CORO_EXPECT(cond)   do{						\
+	if(!(cond)){							\
+	    printf("%s:%d check fail: %s\n", __FILE__, __LINE__, #cond);	\
+	    atomic_inc(&__coro_bad);					\
+	}								\
+    }while(0)
+
+static atomic_t		    __coro_bad;
+static atomic_t		    __coro_done;
+
+static emit_t		    __coro_emit;    // dispatch test's
+static edp::sock	    *__coro_sock;   // sock test's
+
+static int coro_wait(atomic_t *count, int num){
+    int		i;
+
+    for(i = 0; (i < CORO_WAIT_MS) && (*count < num); i++){
+	usleep(1000);
+    }
+
+    return (*count >= num) ? 0 : -ETIMEDOUT;
+}
+
+enum coro_start_type{
+    kCORO_START_DISPATCH = 0,
+    kCORO_START_ECHO,
+};
+
+static edp::task coro_dispatch(emit_t em);
+static edp::task coro_echo(edp::sock *s);
+
+static int coro_start_handler(emit_t em, edp_event_t *ev){
+    bool	valid = false;
+
+    switch(ev->ev_type){
+	case kCORO_START_DISPATCH:
+	    valid = coro_dispatch(__coro_emit).valid();
+	    break;
+
+	case kCORO_START_ECHO:
+	    valid = coro_echo(__coro_sock).valid();
+	    break;
+    }
+
+    // no frame, it never says it is done
+    if(!valid){
+	atomic_inc(&__coro_bad);
+	atomic_inc(&__coro_done);
+    }
+
+    return 0;
+}
+
+static void coro_start_done(edp_event_t *ev, void *data, int errcode){
+}
+
+static int coro_start(emit_t starter, edp_event_t *ev, int type){
+    edp_event_init(ev, type, kEDP_EVENT_PRIORITY_NORM);
+
+    return emit_dispatch(starter, ev, coro_start_done, NULL);
+}
+
+/*
+ * dispatch: each await gives what the handler returned, and the
+ * coroutine goes on on the worker it started on
+ */
+enum coro_dispatch_type{
+    kCORO_DISPATCH_VALUE = 0,	// gives its cv_value
+    kCORO_DISPATCH_FAIL,	// gives -EIO
+};
+
+// ev_data belongs to the awaiter
+struct coro_value{
+    edp_event_t		cv_event;
+    int			cv_value;
+};
+
+static int coro_value_handler(emit_t em, edp_event_t *ev){
+    return ((struct coro_value *)ev)->cv_value;
+}
+
+static int coro_fail_handler(emit_t em, edp_event_t *ev){
+    return -EIO;
+}
+
+static edp::task coro_dispatch(emit_t em){
+    edp::emitter	emitter(em);
+    struct coro_value	cv;
+    edp_event_t		ev;
+    int			self = __edp_self();
+    int			i, ret;
+
+    for(i = 0; i < CORO_DISPATCH_NUM; i++){
+	edp_event_init(&cv.cv_event, kCORO_DISPATCH_VALUE, kEDP_EVENT_PRIORITY_NORM);
+	cv.cv_value = i;
+
+	ret = co_await emitter.dispatch(&cv.cv_event);
+	CORO_EXPECT(ret == i);
+	CORO_EXPECT((self >= 0) && (__edp_self() == self));
+    }
+
+    edp_event_init(&ev, kCORO_DISPATCH_FAIL, kEDP_EVENT_PRIORITY_NORM);
+    ret = co_await emitter.dispatch(&ev);
+    CORO_EXPECT(ret == -EIO);
+
+    atomic_inc(&__coro_done);
+}
+
+static int coro_test_dispatch(emit_t starter){
+    edp_event_t	    ev;
+
+    atomic_reset(&__coro_bad);
+    atomic_reset(&__coro_done);
+
+    CORO_CHECK(emit_create(NULL, &__coro_emit) == 0);
+    emit_add_handler(__coro_emit, kCORO_DISPATCH_VALUE, coro_value_handler);
+    emit_add_handler(__coro_emit, kCORO_DISPATCH_FAIL, coro_fail_handler);
+
+    CORO_CHECK(coro_start(starter, &ev, kCORO_START_DISPATCH) == 0);
+    CORO_CHECK(coro_wait(&__coro_done, 1) == 0);
+    CORO_CHECK(__coro_bad == 0);
+
+    CORO_CHECK(emit_destroy(__coro_emit) == 0);
+
+    return 0;
+}
+
+/*
+ * sock: writes give the bytes written, messages come back whole from the
+ * echo server, a read after it hung up ends the stream
+ */
+static int		    __echo_listen = -1;
+static volatile int	    __echo_connected;
+
+// echo what comes in until "bye", then hang up
+static void *coro_echo_server(void *data){
+    char	buf[CORO_ECHO_MAX];
+    ssize_t	len;
+    int		fd;
+
+    fd = accept(__echo_listen, NULL, NULL);
+    if(fd < 0)
+	return NULL;
+
+    while((len = read(fd, buf, sizeof(buf))) > 0){
+	if((len >= 3) && (memcmp(buf + len - 3, "bye", 3) == 0))
+	    break;
+
+	if(write(fd, buf, len) != len)
+	    break;
+    }
+
+    close(fd);
+
+    return NULL;
+}
+
+static int coro_echo_listen(short *port){
+    struct sockaddr_in	sa;
+    socklen_t		len = sizeof(sa);
+
+    __echo_listen = socket(AF_INET, SOCK_STREAM, 0);
+    if(__echo_listen < 0)
+	return -errno;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = 0;
+
+    if((bind(__echo_listen, (struct sockaddr *)&sa, sizeof(sa)) != 0) ||
+	    (listen(__echo_listen, 1) != 0) ||
+	    (getsockname(__echo_listen, (struct sockaddr *)&sa, &len) != 0)){
+	close(__echo_listen);
+	return -errno;
+    }
+
+    *port = (short)ntohs(sa.sin_port);
+
+    return 0;
+}
+
+static edp::task coro_echo(edp::sock *s){
+    char	    out[CORO_ECHO_MAX], in[CORO_ECHO_MAX];
+    ioctx_t	    wio, rio;
+    int		    i, len, got, ret;
+
+    for(i = 0; i < CORO_ECHO_NUM; i++){
+	len = snprintf(out, sizeof(out), "echo-%d", i);
+
+	ioctx_init(&wio, kIOCTX_IO_TYPE_SOCK, kIOCTX_DATA_TYPE_PTR);
+	wio.ioc_data = out;
+	wio.ioc_size = len;
+	ret = co_await s->write(&wio);
+	CORO_EXPECT(ret == len);
+
+	got = 0;
+	while(got < len){
+	    ioctx_init(&rio, kIOCTX_IO_TYPE_SOCK, kIOCTX_DATA_TYPE_PTR);
+	    rio.ioc_data = in + got;
+	    rio.ioc_size = len - got;
+
+	    ret = co_await s->read(&rio);
+	    if(ret <= 0)
+		break;
+	    got += ret;
+	}
+	CORO_EXPECT((got == len) && (memcmp(in, out, len) == 0));
+    }
+
+    // the server hangs up, the stream ends
+    ioctx_init(&wio, kIOCTX_IO_TYPE_SOCK, kIOCTX_DATA_TYPE_PTR);
+    wio.ioc_data = (void *)"bye";
+    wio.ioc_size = 3;
+    ret = co_await s->write(&wio);
+    CORO_EXPECT(ret == 3);
+
+    ioctx_init(&rio, kIOCTX_IO_TYPE_SOCK, kIOCTX_DATA_TYPE_PTR);
+    rio.ioc_data = in;
+    rio.ioc_size = sizeof(in);
+    ret = co_await s->read(&rio);
+    CORO_EXPECT((ret == 0) || (ret == -kEDPNET_ERR_CLOSE));
+
+    atomic_inc(&__coro_done);
+}
+
+static void coro_sock_connect(edpnet_sock_t es, void *data){
+    __echo_connected = 1;
+}
+
+static void coro_sock_event(edpnet_sock_t es, void *data){
+}
+
+static int coro_test_sock(emit_t starter){
+    edpnet_sock_cbs_t	cbs;
+    edpnet_sock_t	es;
+    edpnet_addr_t	addr;
+    edp_event_t		ev;
+    spi_thread_t	thrd;
+    short		port;
+    int			i;
+
+    atomic_reset(&__coro_bad);
+    atomic_reset(&__coro_done);
+
+    CORO_CHECK(coro_echo_listen(&port) == 0);
+    spi_thread_create(&thrd, coro_echo_server, NULL);
+
+    cbs.sock_connect = coro_sock_connect;
+    cbs.data_ready = coro_sock_event;
+    cbs.data_drain = coro_sock_event;
+    cbs.sock_error = coro_sock_event;
+    cbs.sock_close = coro_sock_event;
+    CORO_CHECK(edpnet_sock_create(&es, &cbs, NULL) == 0);
+
+    addr.ea_type = kEDPNET_ADDR_TYPE_IPV4;
+    edpnet_pton(kEDPNET_ADDR_TYPE_IPV4, "127.0.0.1", &addr.ea_v4.eia_ip);
+    addr.ea_v4.eia_port = port;
+    CORO_CHECK(edpnet_sock_connect(es, &addr) == 0);
+
+    for(i = 0; (i < CORO_WAIT_MS) && !__echo_connected; i++){
+	usleep(1000);
+    }
+    CORO_CHECK(__echo_connected);
+
+    // the coroutine takes the callbacks over from here
+    __coro_sock = new edp::sock(es);
+    CORO_CHECK(coro_start(starter, &ev, kCORO_START_ECHO) == 0);
+    CORO_CHECK(coro_wait(&__coro_done, 1) == 0);
+    CORO_CHECK(__coro_bad == 0);
+
+    spi_thread_join(thrd);
+    close(__echo_listen);
+
+    edpnet_sock_destroy(es);
+    delete __coro_sock;
+
+    return 0;
+}
+
+int main(){
+    emit_t	    starter;
+    int		    ret = -1;
+
+    if(edp_init(2) != 0){
+	printf("edp init fail\n");
+	return -1;
+    }
+
+    emit_create(NULL, &starter);
+    emit_add_handler(starter, kCORO_START_DISPATCH, coro_start_handler);
+    emit_add_handler(starter, kCORO_START_ECHO, coro_start_handler);
+
+    if((coro_test_dispatch(starter) == 0) && (coro_test_sock(starter) == 0)){
+	ret = 0;
+    }
+
+    printf("coro test %s\n", (ret == 0) ? "pass" : "fail");
+
+    emit_destroy(starter);
+    edp_fini();
+
+    return ret;
+}
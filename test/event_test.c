@@ -0,0 +1,467 @@
+
+#include "edp.h"
+#include "emitter.h"
+
+#include "logger.h"
+#include "mcache.h"
+
+#include <stdio.h>
+
+/*
+ * event tests: strand FIFO with several producers, coalescing, publish
+ * refcounting & errors, the event pool, and ordered events while workers
+ * are resized. returns 0 if all of them pass.
+ */
+
+#define EVENT_WAIT_MS		    10000
+#define EVENT_WORKERS		    3
+#define EVENT_WORKER_MAX	    4
+
+#define EVENT_STRAND_PRODUCERS	    3
+#define EVENT_STRAND_NUM	    30000   // per producer
+#define EVENT_STRAND_BATCH	    4
+
+#define EVENT_PUBLISH_SUBS	    4
+
+#define EVENT_POOL_NUM		    100000
+
+#define EVENT_RESIZE_EMITS	    8
+#define EVENT_RESIZE_NUM	    100000
+
+#define EVENT_CHECK(cond)   do{						\
+	if(!(cond)){							\
+	    printf("%s:%d check fail: %s\n", __FILE__, __LINE__, #cond);	\
+	    return -1;							\
+	}								\
+    }while(0)
+
+// an event numbered within its source
+struct event_seq{
+    edp_event_t		es_event;
+    int			es_src;
+    int			es_seq;
+};
+
+static atomic_t		    __event_done;
+static atomic_t		    __event_bad;
+static volatile int	    __event_errcode;
+
+static void event_count(edp_event_t *ev, void *data, int errcode){
+    if(errcode != 0)
+	__event_errcode = errcode;
+    atomic_inc(&__event_done);
+}
+
+static int event_wait(atomic_t *count, int num){
+    int		i;
+
+    for(i = 0; (i < EVENT_WAIT_MS) && (*count < num); i++){
+	usleep(1000);
+    }
+
+    return (*count >= num) ? 0 : -ETIMEDOUT;
+}
+
+static void event_reset(void){
+    atomic_reset(&__event_done);
+    atomic_reset(&__event_bad);
+    __event_errcode = 0;
+}
+
+static void event_ordered(edp_event_t *ev, int type){
+    edp_event_init(ev, type, kEDP_EVENT_PRIORITY_NORM);
+    ev->ev_flags = kEDP_EVENT_FLAG_ORDERED;
+}
+
+/*
+ * strand: events of producers running at once never overlap, and each
+ * producer's ones run in the order it dispatched them
+ */
+static emit_t		    __strand_emit;
+static int		    __strand_last[EVENT_STRAND_PRODUCERS];
+static atomic_t		    __strand_running;
+static struct event_seq	    *__strand_events;
+
+static int event_strand_handler(emit_t em, edp_event_t *ev){
+    struct event_seq	*es = (struct event_seq *)ev;
+
+    if(atomic_inc(&__strand_running) != 1)
+	atomic_inc(&__event_bad);
+
+    if(es->es_seq != __strand_last[es->es_src] + 1)
+	atomic_inc(&__event_bad);
+    __strand_last[es->es_src] = es->es_seq;
+
+    atomic_dec(&__strand_running);
+
+    return 0;
+}
+
+static void *event_strand_producer(void *data){
+    int			src = (int)(long)data;
+    struct event_seq	*es = &__strand_events[src * EVENT_STRAND_NUM];
+    edp_event_t		*evs[EVENT_STRAND_BATCH];
+    int			i, j;
+
+    for(i = 0; i < EVENT_STRAND_NUM; i += EVENT_STRAND_BATCH){
+	for(j = 0; j < EVENT_STRAND_BATCH; j++){
+	    es[i + j].es_src = src;
+	    es[i + j].es_seq = i + j + 1;
+	    edp_event_init(&es[i + j].es_event, 0, kEDP_EVENT_PRIORITY_NORM);
+	    emit_prepare(__strand_emit, &es[i + j].es_event, event_count, NULL);
+	    evs[j] = &es[i + j].es_event;
+	}
+
+	emit_dispatch_batch(evs, EVENT_STRAND_BATCH);
+    }
+
+    return NULL;
+}
+
+static int event_test_strand(void){
+    spi_thread_t    thrd[EVENT_STRAND_PRODUCERS];
+    int		    i;
+
+    event_reset();
+
+    __strand_events = mheap_alloc(sizeof(struct event_seq) *
+	    EVENT_STRAND_NUM * EVENT_STRAND_PRODUCERS);
+    EVENT_CHECK(__strand_events != NULL);
+
+    EVENT_CHECK(emit_create(NULL, &__strand_emit) == 0);
+    emit_add_handler(__strand_emit, 0, event_strand_handler);
+    EVENT_CHECK(emit_strand(__strand_emit, kEDP_EVENT_PRIORITY_NORM) == 0);
+
+    for(i = 0; i < EVENT_STRAND_PRODUCERS; i++){
+	spi_thread_create(&thrd[i], event_strand_producer, (void *)(long)i);
+    }
+
+    for(i = 0; i < EVENT_STRAND_PRODUCERS; i++){
+	spi_thread_join(thrd[i]);
+    }
+
+    EVENT_CHECK(event_wait(&__event_done, EVENT_STRAND_NUM * EVENT_STRAND_PRODUCERS) == 0);
+    EVENT_CHECK(__event_bad == 0);
+    EVENT_CHECK(__event_errcode == 0);
+    for(i = 0; i < EVENT_STRAND_PRODUCERS; i++){
+	EVENT_CHECK(__strand_last[i] == EVENT_STRAND_NUM);
+    }
+
+    EVENT_CHECK(emit_destroy(__strand_emit) == 0);
+    mheap_free(__strand_events);
+
+    return 0;
+}
+
+/*
+ * coalescing: while one of a type is pending, more of it are refused with
+ * -EALREADY, a publish counts it as delivered. a gate event holds the
+ * emitter's home worker so they stay pending, all of them are ordered.
+ */
+enum event_coalesce_type{
+    kEVENT_COALESCE_GATE = 0,
+    kEVENT_COALESCE_ONE,
+};
+
+static volatile int	    __coalesce_gate;
+static atomic_t		    __coalesce_runs;
+
+static int event_gate_handler(emit_t em, edp_event_t *ev){
+    while(__coalesce_gate)
+	usleep(1000);
+
+    return 0;
+}
+
+static int event_coalesce_handler(emit_t em, edp_event_t *ev){
+    atomic_inc(&__coalesce_runs);
+
+    return 0;
+}
+
+static int event_test_coalesce(void){
+    emit_t	    em, other, subs[2];
+    edp_event_t	    gate, one, two, three, pub;
+
+    event_reset();
+    atomic_reset(&__coalesce_runs);
+
+    EVENT_CHECK(emit_create(NULL, &em) == 0);
+    emit_add_handler(em, kEVENT_COALESCE_GATE, event_gate_handler);
+    emit_add_handler(em, kEVENT_COALESCE_ONE, event_coalesce_handler);
+    EVENT_CHECK(emit_coalesce(em, kEVENT_COALESCE_ONE) == 0);
+
+    EVENT_CHECK(emit_create(NULL, &other) == 0);
+    emit_add_handler(other, kEVENT_COALESCE_ONE, event_coalesce_handler);
+
+    __coalesce_gate = 1;
+    event_ordered(&gate, kEVENT_COALESCE_GATE);
+    EVENT_CHECK(emit_dispatch(em, &gate, event_count, NULL) == 0);
+
+    event_ordered(&one, kEVENT_COALESCE_ONE);
+    EVENT_CHECK(emit_dispatch(em, &one, event_count, NULL) == 0);
+    event_ordered(&two, kEVENT_COALESCE_ONE);
+    EVENT_CHECK(emit_dispatch(em, &two, event_count, NULL) == -EALREADY);
+
+    // delivered to other, coalesced on em: no error
+    subs[0] = em;
+    subs[1] = other;
+    event_ordered(&pub, kEVENT_COALESCE_ONE);
+    EVENT_CHECK(emit_publish(subs, 2, &pub, event_count, NULL) == 0);
+
+    __coalesce_gate = 0;
+
+    // gate, one & the publish
+    EVENT_CHECK(event_wait(&__event_done, 3) == 0);
+    EVENT_CHECK(__event_errcode == 0);
+    EVENT_CHECK(__coalesce_runs == 2);
+
+    // pending no more, the next one goes in
+    event_ordered(&three, kEVENT_COALESCE_ONE);
+    EVENT_CHECK(emit_dispatch(em, &three, event_count, NULL) == 0);
+    EVENT_CHECK(event_wait(&__event_done, 4) == 0);
+    EVENT_CHECK(__coalesce_runs == 3);
+
+    EVENT_CHECK(emit_destroy(other) == 0);
+    EVENT_CHECK(emit_destroy(em) == 0);
+
+    return 0;
+}
+
+/*
+ * publish: cb runs once after every subscriber finished and every hold
+ * was released, with the first error one of them gave
+ */
+static edp_event_t * volatile	__publish_held;
+static atomic_t			__publish_runs;
+static edp_event_t		*__publish_event;
+
+static int event_publish_handler(emit_t em, edp_event_t *ev){
+    atomic_inc(&__publish_runs);
+
+    if(emit_published(ev) != __publish_event)
+	atomic_inc(&__event_bad);
+
+    return 0;
+}
+
+static int event_publish_hold(emit_t em, edp_event_t *ev){
+    atomic_inc(&__publish_runs);
+
+    emit_publish_hold(ev);
+    __publish_held = ev;
+
+    return 0;
+}
+
+static int event_publish_fail(emit_t em, edp_event_t *ev){
+    atomic_inc(&__publish_runs);
+
+    return -EIO;
+}
+
+static int event_test_publish(void){
+    emit_t	    subs[EVENT_PUBLISH_SUBS];
+    edp_event_t	    pub;
+    int		    i;
+
+    event_reset();
+    atomic_reset(&__publish_runs);
+    __publish_held = NULL;
+    __publish_event = &pub;
+
+    for(i = 0; i < EVENT_PUBLISH_SUBS; i++){
+	EVENT_CHECK(emit_create(NULL, &subs[i]) == 0);
+    }
+    emit_add_handler(subs[0], 0, event_publish_hold);
+    emit_add_handler(subs[1], 0, event_publish_fail);
+    for(i = 2; i < EVENT_PUBLISH_SUBS; i++){
+	emit_add_handler(subs[i], 0, event_publish_handler);
+    }
+
+    edp_event_init(&pub, 0, kEDP_EVENT_PRIORITY_NORM);
+    EVENT_CHECK(emit_publish(subs, EVENT_PUBLISH_SUBS, &pub, event_count, NULL) == 0);
+
+    // all ran, one still holds it
+    EVENT_CHECK(event_wait(&__publish_runs, EVENT_PUBLISH_SUBS) == 0);
+    usleep(50 * 1000);
+    EVENT_CHECK(__publish_held != NULL);
+    EVENT_CHECK(__event_done == 0);
+
+    emit_publish_release(__publish_held);
+    EVENT_CHECK(event_wait(&__event_done, 1) == 0);
+    EVENT_CHECK(__event_errcode == -EIO);
+    EVENT_CHECK(__event_bad == 0);
+
+    // once only
+    usleep(50 * 1000);
+    EVENT_CHECK(__event_done == 1);
+
+    for(i = 0; i < EVENT_PUBLISH_SUBS; i++){
+	EVENT_CHECK(emit_destroy(subs[i]) == 0);
+    }
+
+    return 0;
+}
+
+/*
+ * event pool: payloads of every class & the heap, blocks allocated here
+ * and freed on the workers
+ */
+static const size_t	    __pool_sizes[] = {0, 8, 100, 1000, 4000, 10000};
+
+static int event_pool_handler(emit_t em, edp_event_t *ev){
+    unsigned char   *data = edp_event_payload(ev);
+    size_t	    i, size = edp_event_size(ev);
+
+    for(i = 0; i < size; i++){
+	if(data[i] != (unsigned char)(size + i)){
+	    atomic_inc(&__event_bad);
+	    break;
+	}
+    }
+
+    return 0;
+}
+
+static void event_pool_free(edp_event_t *ev, void *data, int errcode){
+    edp_event_free(ev);
+    atomic_inc(&__event_done);
+}
+
+static int event_test_pool(void){
+    emit_t	    em;
+    edp_event_t	    *ev;
+    unsigned char   *data;
+    size_t	    size, j;
+    int		    i, num = sizeof(__pool_sizes) / sizeof(__pool_sizes[0]);
+
+    event_reset();
+
+    EVENT_CHECK(emit_create(NULL, &em) == 0);
+    emit_add_handler(em, 0, event_pool_handler);
+
+    for(i = 0; i < EVENT_POOL_NUM; i++){
+	size = __pool_sizes[i % num];
+	ev = edp_event_alloc(0, kEDP_EVENT_PRIORITY_NORM, size);
+	EVENT_CHECK(ev != NULL);
+	EVENT_CHECK(edp_event_size(ev) == size);
+	EVENT_CHECK(((uintptr_t)edp_event_payload(ev) & 7) == 0);
+
+	data = edp_event_payload(ev);
+	for(j = 0; j < size; j++){
+	    data[j] = (unsigned char)(size + j);
+	}
+
+	EVENT_CHECK(emit_dispatch(em, ev, event_pool_free, NULL) == 0);
+
+	// keep blocks going round instead of piling up
+	while(i - __event_done > 1000)
+	    spi_thread_yield();
+    }
+
+    EVENT_CHECK(event_wait(&__event_done, EVENT_POOL_NUM) == 0);
+    EVENT_CHECK(__event_bad == 0);
+
+    edp_event_drain();
+    EVENT_CHECK(emit_destroy(em) == 0);
+
+    return 0;
+}
+
+/*
+ * resize: ordered events of each emitter run in order while workers come
+ * and go under them
+ */
+static emit_t		    __resize_emits[EVENT_RESIZE_EMITS];
+static int		    __resize_last[EVENT_RESIZE_EMITS];
+static struct event_seq	    *__resize_events;
+
+static int event_resize_handler(emit_t em, edp_event_t *ev){
+    struct event_seq	*es = (struct event_seq *)ev;
+
+    if(es->es_seq != __resize_last[es->es_src] + 1)
+	atomic_inc(&__event_bad);
+    __resize_last[es->es_src] = es->es_seq;
+
+    return 0;
+}
+
+static void *event_resize_producer(void *data){
+    struct event_seq	*es;
+    int			i;
+
+    for(i = 0; i < EVENT_RESIZE_NUM; i++){
+	es = &__resize_events[i];
+	es->es_src = i % EVENT_RESIZE_EMITS;
+	es->es_seq = i / EVENT_RESIZE_EMITS + 1;
+	event_ordered(&es->es_event, 0);
+
+	while(emit_dispatch(__resize_emits[es->es_src], &es->es_event, event_count, NULL) != 0)
+	    spi_thread_yield();
+    }
+
+    return NULL;
+}
+
+static int event_test_resize(void){
+    spi_thread_t    thrd;
+    int		    i, resizes = 0;
+
+    event_reset();
+
+    __resize_events = mheap_alloc(sizeof(struct event_seq) * EVENT_RESIZE_NUM);
+    EVENT_CHECK(__resize_events != NULL);
+
+    for(i = 0; i < EVENT_RESIZE_EMITS; i++){
+	EVENT_CHECK(emit_create(NULL, &__resize_emits[i]) == 0);
+	emit_add_handler(__resize_emits[i], 0, event_resize_handler);
+    }
+
+    spi_thread_create(&thrd, event_resize_producer, NULL);
+
+    for(i = 0; (i < EVENT_WAIT_MS * 5) && (__event_done < EVENT_RESIZE_NUM); i++){
+	edp_workers_resize(1 + (resizes++ % EVENT_WORKER_MAX));
+	usleep(200);
+    }
+
+    spi_thread_join(thrd);
+
+    EVENT_CHECK(event_wait(&__event_done, EVENT_RESIZE_NUM) == 0);
+    EVENT_CHECK(__event_bad == 0);
+    EVENT_CHECK(resizes > 1);
+
+    EVENT_CHECK(edp_workers_resize(EVENT_WORKERS) == 0);
+
+    for(i = 0; i < EVENT_RESIZE_EMITS; i++){
+	EVENT_CHECK(__resize_last[i] == EVENT_RESIZE_NUM / EVENT_RESIZE_EMITS);
+	EVENT_CHECK(emit_destroy(__resize_emits[i]) == 0);
+    }
+    mheap_free(__resize_events);
+
+    return 0;
+}
+
+int main(){
+    edp_conf_t	    conf;
+    int		    ret = -1;
+
+    edp_conf_init(&conf, EVENT_WORKERS);
+    conf.ec_worker_max = EVENT_WORKER_MAX;
+    if(edp_init_conf(&conf) != 0){
+	printf("edp init fail\n");
+	return -1;
+    }
+
+    if((event_test_strand() == 0) && (event_test_coalesce() == 0) &&
+	    (event_test_publish() == 0) && (event_test_pool() == 0) &&
+	    (event_test_resize() == 0)){
+	ret = 0;
+    }
+
+    printf("event test %s\n", (ret == 0) ? "pass" : "fail");
+
+    edp_fini();
+
+    return ret;
+}
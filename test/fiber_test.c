@@ -0,0 +1,206 @@
+
+#include "edp.h"
+#include "emitter.h"
+#include "fiber.h"
+
+#include "logger.h"
+
+#include <stdio.h>
+
+/*
+ * fiber tests: suspend & resume from another thread, a resume before the
+ * suspend, fiber_sleep, and a resume after the fiber's worker retired.
+ * returns 0 if all of them pass.
+ */
+
+#define FIBER_WAIT_MS		    3000
+
+#define FIBER_CHECK(cond)   do{						\
+	if(!(cond)){							\
+	    printf("%s:%d check fail: %s\n", __FILE__, __LINE__, #cond);	\
+	    return -1;							\
+	}								\
+    }while(0)
+
+enum fiber_test_type{
+    kFIBER_TEST_SUSPEND = 0,	// suspend, main thread resumes it
+    kFIBER_TEST_EARLY,		// resume itself, then suspend
+    kFIBER_TEST_SLEEP,		// fiber_sleep
+    kFIBER_TEST_OTHER,		// plain work while one is suspended
+    kFIBER_TEST_MAX,
+};
+
+static fiber_t * volatile   __fiber_waiting;
+static volatile int	    __fiber_worker;	// worker it resumed on
+static volatile uint64_t    __fiber_slept;	// ns fiber_sleep took
+static atomic_t		    __fiber_done;
+static volatile int	    __fiber_errcode;
+
+static int fiber_suspend_handler(emit_t em, edp_event_t *ev){
+    int		ret;
+
+    __fiber_waiting = fiber_self();
+    ret = fiber_suspend();
+    __fiber_worker = __edp_self();
+
+    return ret;
+}
+
+static int fiber_early_handler(emit_t em, edp_event_t *ev){
+    int		ret;
+
+    ret = fiber_resume(fiber_self(), 7);
+    if(ret != 0)
+	return ret;
+
+    return fiber_suspend();
+}
+
+static int fiber_sleep_handler(emit_t em, edp_event_t *ev){
+    uint64_t	start;
+    int		ret;
+
+    start = spi_time_now();
+    ret = fiber_sleep(50);
+    __fiber_slept = spi_time_now() - start;
+
+    return ret;
+}
+
+static int fiber_other_handler(emit_t em, edp_event_t *ev){
+    return 0;
+}
+
+static void fiber_test_done(edp_event_t *ev, void *data, int errcode){
+    __fiber_errcode = errcode;
+    atomic_inc(&__fiber_done);
+}
+
+static int fiber_wait(int num){
+    int		i;
+
+    for(i = 0; (i < FIBER_WAIT_MS) && (__fiber_done < num); i++){
+	usleep(1000);
+    }
+
+    return (__fiber_done >= num) ? 0 : -ETIMEDOUT;
+}
+
+static int fiber_wait_suspended(void){
+    int		i;
+
+    for(i = 0; (i < FIBER_WAIT_MS) && (__fiber_waiting == NULL); i++){
+	usleep(1000);
+    }
+
+    return (__fiber_waiting != NULL) ? 0 : -ETIMEDOUT;
+}
+
+// fire one event of type at em, on worker cpuid if >= 0
+static int fiber_fire(emit_t em, edp_event_t *ev, int type, int cpuid){
+    atomic_reset(&__fiber_done);
+    __fiber_errcode = -1;
+
+    edp_event_init(ev, type, kEDP_EVENT_PRIORITY_NORM);
+    ev->ev_cpuid = cpuid;
+
+    return emit_dispatch(em, ev, fiber_test_done, NULL);
+}
+
+static int fiber_test_suspend(emit_t em, emit_t plain){
+    edp_event_t	    ev, other;
+
+    __fiber_waiting = NULL;
+    FIBER_CHECK(fiber_fire(em, &ev, kFIBER_TEST_SUSPEND, -1) == 0);
+    FIBER_CHECK(fiber_wait_suspended() == 0);
+
+    // the only worker goes on with other events meanwhile
+    FIBER_CHECK(fiber_fire(plain, &other, kFIBER_TEST_OTHER, -1) == 0);
+    FIBER_CHECK(fiber_wait(1) == 0);
+    FIBER_CHECK(__fiber_errcode == 0);
+
+    atomic_reset(&__fiber_done);
+    FIBER_CHECK(fiber_resume(__fiber_waiting, 42) == 0);
+    FIBER_CHECK(fiber_wait(1) == 0);
+    FIBER_CHECK(__fiber_errcode == 42);
+
+    return 0;
+}
+
+static int fiber_test_early(emit_t em){
+    edp_event_t	    ev;
+
+    FIBER_CHECK(fiber_fire(em, &ev, kFIBER_TEST_EARLY, -1) == 0);
+    FIBER_CHECK(fiber_wait(1) == 0);
+    FIBER_CHECK(__fiber_errcode == 7);
+
+    return 0;
+}
+
+static int fiber_test_sleep(emit_t em){
+    edp_event_t	    ev;
+
+    FIBER_CHECK(fiber_fire(em, &ev, kFIBER_TEST_SLEEP, -1) == 0);
+    FIBER_CHECK(fiber_wait(1) == 0);
+    FIBER_CHECK(__fiber_errcode == 0);
+    FIBER_CHECK(__fiber_slept >= 50 * 1000000ULL);
+
+    return 0;
+}
+
+// suspend on worker 1, retire it, the resume runs on worker 0
+static int fiber_test_retired(emit_t em){
+    edp_event_t	    ev;
+
+    FIBER_CHECK(edp_workers_resize(2) == 0);
+
+    __fiber_waiting = NULL;
+    FIBER_CHECK(fiber_fire(em, &ev, kFIBER_TEST_SUSPEND, 1) == 0);
+    FIBER_CHECK(fiber_wait_suspended() == 0);
+
+    FIBER_CHECK(edp_workers_resize(1) == 0);
+    usleep(100 * 1000);
+
+    __fiber_worker = -1;
+    FIBER_CHECK(fiber_resume(__fiber_waiting, 9) == 0);
+    FIBER_CHECK(fiber_wait(1) == 0);
+    FIBER_CHECK(__fiber_errcode == 9);
+    FIBER_CHECK(__fiber_worker == 0);
+
+    return 0;
+}
+
+int main(){
+    edp_conf_t	    conf;
+    emit_t	    em, plain;
+    int		    ret = -1;
+
+    edp_conf_init(&conf, 1);
+    conf.ec_worker_max = 2;
+    if(edp_init_conf(&conf) != 0){
+	printf("edp init fail\n");
+	return -1;
+    }
+
+    emit_create(NULL, &em);
+    emit_add_handler(em, kFIBER_TEST_SUSPEND, fiber_suspend_handler);
+    emit_add_handler(em, kFIBER_TEST_EARLY, fiber_early_handler);
+    emit_add_handler(em, kFIBER_TEST_SLEEP, fiber_sleep_handler);
+    emit_fiber(em);
+
+    emit_create(NULL, &plain);
+    emit_add_handler(plain, kFIBER_TEST_OTHER, fiber_other_handler);
+
+    if((fiber_test_suspend(em, plain) == 0) && (fiber_test_early(em) == 0) &&
+	    (fiber_test_sleep(em) == 0) && (fiber_test_retired(em) == 0)){
+	ret = 0;
+    }
+
+    printf("fiber test %s\n", (ret == 0) ? "pass" : "fail");
+
+    emit_destroy(plain);
+    emit_destroy(em);
+    edp_fini();
+
+    return ret;
+}
@@ -0,0 +1,224 @@
+
+#include "edp.h"
+#include "emitter.h"
+#include "timer.h"
+
+#include "logger.h"
+
+#include <stdio.h>
+
+/*
+ * timer tests: the wheel alone (expiry on the right tick at every level,
+ * del), then delayed & periodic dispatch of emitters and their cancel.
+ * returns 0 if all of them pass.
+ */
+
+#define TIMER_WAIT_MS		    3000
+#define TIMER_WHEEL_NUM		    8
+
+#define TIMER_CHECK(cond)   do{						\
+	if(!(cond)){							\
+	    printf("%s:%d check fail: %s\n", __FILE__, __LINE__, #cond);	\
+	    return -1;							\
+	}								\
+    }while(0)
+
+static int		    __timer_fired;
+
+static void timer_wheel_fire(edp_timer_t *tm, void *data){
+    uint64_t	*tick = (uint64_t *)data;
+
+    // never before it is due
+    if(tm->et_expire > *tick)
+	return ;
+
+    tm->et_state = kEDP_TIMER_FIRED;
+    __timer_fired++;
+}
+
+static int timer_test_wheel(void){
+    // root, first & second level, and a level boundary
+    static const uint64_t   delays[TIMER_WHEEL_NUM] = {
+	1, 255, 256, 300, 16384, 16389, (1 << 20) + 7, (1 << 22) + 3,
+    };
+    timer_wheel_t   tw;
+    edp_timer_t	    tms[TIMER_WHEEL_NUM], del;
+    uint64_t	    start = 1000, tick;
+    int		    i;
+
+    timer_wheel_init(&tw, start);
+
+    for(i = 0; i < TIMER_WHEEL_NUM; i++){
+	edp_timer_init(&tms[i]);
+	tms[i].et_expire = start + delays[i];
+	timer_wheel_add(&tw, &tms[i]);
+    }
+
+    edp_timer_init(&del);
+    del.et_expire = start + 10;
+    timer_wheel_add(&tw, &del);
+    timer_wheel_del(&tw, &del);
+
+    TIMER_CHECK(tw.tw_count == TIMER_WHEEL_NUM);
+    TIMER_CHECK(timer_wheel_next(&tw) == start + 1);
+
+    // not a tick early, none late
+    __timer_fired = 0;
+    for(i = 0; i < TIMER_WHEEL_NUM; i++){
+	tick = start + delays[i] - 1;
+	timer_wheel_run(&tw, tick, timer_wheel_fire, &tick);
+	TIMER_CHECK(__timer_fired == i);
+	TIMER_CHECK(tms[i].et_state != kEDP_TIMER_FIRED);
+
+	tick++;
+	timer_wheel_run(&tw, tick, timer_wheel_fire, &tick);
+	TIMER_CHECK(__timer_fired == i + 1);
+	TIMER_CHECK(tms[i].et_state == kEDP_TIMER_FIRED);
+    }
+
+    TIMER_CHECK(tw.tw_count == 0);
+    TIMER_CHECK(del.et_state != kEDP_TIMER_FIRED);
+    TIMER_CHECK(timer_wheel_next(&tw) == 0);
+
+    return 0;
+}
+
+struct timer_probe{
+    atomic_t		tp_runs;    // handler calls
+    atomic_t		tp_done;    // cb calls with 0
+    atomic_t		tp_canceled;// cb calls with -ECANCELED
+    atomic_t		tp_other;   // cb calls with another error
+    uint64_t		tp_ran;	    // ns the handler ran first
+};
+
+static int timer_handler(emit_t em, edp_event_t *ev){
+    struct timer_probe	*tp = (struct timer_probe *)emit_get(em);
+
+    if(atomic_inc(&tp->tp_runs) == 1)
+	tp->tp_ran = spi_time_now();
+
+    return 0;
+}
+
+static void timer_done(edp_event_t *ev, void *data, int errcode){
+    struct timer_probe	*tp = (struct timer_probe *)data;
+
+    if(errcode == 0){
+	atomic_inc(&tp->tp_done);
+    }else if(errcode == -ECANCELED){
+	atomic_inc(&tp->tp_canceled);
+    }else{
+	atomic_inc(&tp->tp_other);
+    }
+}
+
+static int timer_wait(atomic_t *count, int num){
+    int		i;
+
+    for(i = 0; (i < TIMER_WAIT_MS) && (*count < num); i++){
+	usleep(1000);
+    }
+
+    return (*count >= num) ? 0 : -ETIMEDOUT;
+}
+
+static void timer_probe_init(struct timer_probe *tp){
+    atomic_reset(&tp->tp_runs);
+    atomic_reset(&tp->tp_done);
+    atomic_reset(&tp->tp_canceled);
+    atomic_reset(&tp->tp_other);
+    tp->tp_ran = 0;
+}
+
+static int timer_test_after(emit_t em, struct timer_probe *tp){
+    emit_timer_t    mt;
+    uint64_t	    start;
+
+    timer_probe_init(tp);
+    emit_timer_init(&mt, 0, kEDP_EVENT_PRIORITY_NORM);
+
+    start = spi_time_now();
+    TIMER_CHECK(emit_dispatch_after(em, &mt, timer_done, tp, 30) == 0);
+    TIMER_CHECK(timer_wait(&tp->tp_done, 1) == 0);
+
+    TIMER_CHECK(tp->tp_runs == 1);
+    TIMER_CHECK(tp->tp_ran - start >= 30 * 1000000ULL);
+
+    // fired already
+    TIMER_CHECK(emit_timer_cancel(&mt) == -ENOENT);
+    TIMER_CHECK((tp->tp_canceled == 0) && (tp->tp_other == 0));
+
+    return 0;
+}
+
+static int timer_test_after_cancel(emit_t em, struct timer_probe *tp){
+    emit_timer_t    mt;
+
+    timer_probe_init(tp);
+    emit_timer_init(&mt, 0, kEDP_EVENT_PRIORITY_NORM);
+
+    TIMER_CHECK(emit_dispatch_after(em, &mt, timer_done, tp, 200) == 0);
+    TIMER_CHECK(emit_timer_cancel(&mt) == 0);
+    TIMER_CHECK(timer_wait(&tp->tp_canceled, 1) == 0);
+
+    // past its time, the handler never ran
+    usleep(300 * 1000);
+    TIMER_CHECK(tp->tp_runs == 0);
+    TIMER_CHECK((tp->tp_done == 0) && (tp->tp_canceled == 1) && (tp->tp_other == 0));
+
+    return 0;
+}
+
+static int timer_test_every(emit_t em, struct timer_probe *tp){
+    emit_timer_t    mt;
+    uint64_t	    start;
+    int		    runs;
+
+    timer_probe_init(tp);
+    emit_timer_init(&mt, 0, kEDP_EVENT_PRIORITY_NORM);
+
+    start = spi_time_now();
+    TIMER_CHECK(emit_dispatch_every(em, &mt, timer_done, tp, 10) == 0);
+    TIMER_CHECK(timer_wait(&tp->tp_done, 5) == 0);
+
+    // five runs at 10ms apiece
+    TIMER_CHECK(spi_time_now() - start >= 50 * 1000000ULL);
+
+    TIMER_CHECK(emit_timer_cancel(&mt) == 0);
+    TIMER_CHECK(timer_wait(&tp->tp_canceled, 1) == 0);
+
+    // -ECANCELED was the last call
+    runs = tp->tp_runs;
+    usleep(100 * 1000);
+    TIMER_CHECK(tp->tp_runs == runs);
+    TIMER_CHECK((tp->tp_canceled == 1) && (tp->tp_other == 0));
+    TIMER_CHECK(tp->tp_done == runs);
+
+    return 0;
+}
+
+int main(){
+    struct timer_probe	tp;
+    emit_t		em;
+    int			ret = -1;
+
+    if(edp_init(2) != 0){
+	printf("edp init fail\n");
+	return -1;
+    }
+
+    emit_create(&tp, &em);
+    emit_add_handler(em, 0, timer_handler);
+
+    if((timer_test_wheel() == 0) && (timer_test_after(em, &tp) == 0) &&
+	    (timer_test_after_cancel(em, &tp) == 0) && (timer_test_every(em, &tp) == 0)){
+	ret = 0;
+    }
+
+    printf("timer test %s\n", (ret == 0) ? "pass" : "fail");
+
+    emit_destroy(em);
+    edp_fini();
+
+    return ret;
+}